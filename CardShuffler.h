@@ -3,6 +3,21 @@
 #include <algorithm>	// for std::shuffle
 #include <chrono>		// for system clock 
 #include <random>		// for default_random_engine
+#include <cstdint>
+#include <atomic>
+#include <memory>		// for addressof and allocator_traits
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>	// for the polymorphic allocator
+#endif
+#endif
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L) || __cplusplus >= 202002L
+#include <span>			// for the deck views, C++20 only
+#endif
+#include "ShuffleKernels.h"	// for SIMD interleave and deinterleave
+#include "ShuffleMath.h"	// for multiplicative order and big integer lcm
+#include "ShuffleThreads.h"	// for ParallelFor
+#include "ShuffleRandom.h"	// for bounded random indeces and fast engines
 
 using namespace std;
 
@@ -14,30 +29,107 @@ enum class ShuffleType
 	INSHUFFLE,
 	INV_OUTSHUFFLE,
 	INV_INSHUFFLE,
+	BUCKET_SHUFFLE,		// uniform random shuffle for decks much larger than the cache
+	PARALLEL_SHUFFLE,	// uniform random shuffle on every core, the same result for any thread count
 };
 
-template <class T>
+// selects the kernel used for the deterministic (perfect) shuffle types
+enum class ShuffleMode
+{
+	REFERENCE,		// copy the deck into two halves, then interleave back into the deck
+	IN_PLACE,		// cycle leader algorithm, constant extra memory
+	VECTORIZED,		// copy the deck (or its halves), then interleave or deinterleave with SSE2/AVX2
+	// only pays off while every shuffle is from one family, OUTSHUFFLE and INV_OUTSHUFFLE or
+	// INSHUFFLE and INV_INSHUFFLE, the two move different ranges of the deck so switching
+	// family builds the whole deck, after which FindCard is a linear scan
+	LAZY,			// keep the perfect shuffles as a transform over positions, build the deck on demand
+	PARALLEL,		// VECTORIZED split across the cores, streaming the output past the cache for large decks
+	RECURSIVE,		// divide and conquer rotations, in place and cache oblivious, no block size to tune
+	DOUBLE_BUFFER,	// interleave or deinterleave the deck straight into a second buffer, then swap the two
+};
+
+// URNG is the uniform random number generator for the random shuffle types, any
+// 32 or 64 bit engine works, ShuffleRandom has smaller and faster ones than the default,
+// Allocator provides the deck and the scratch memory, see CardShufflerPmr below
+template <class T, class URNG = std::mt19937_64, class Allocator = std::allocator<T>>
 class CardShuffler
 {
 public:
+	typedef std::vector<T, Allocator> Deck;
 
 	CardShuffler();
+	explicit CardShuffler(const Allocator& alloc);
+	explicit CardShuffler(uint64_t seed, const Allocator& alloc = Allocator());
+	explicit CardShuffler(const URNG& urng, const Allocator& alloc = Allocator());
 	~CardShuffler();
 
 	// deck must have at least 3 cards
-	const size_t MIN_DECK_SIZE = 3;
+	static constexpr size_t MIN_DECK_SIZE = 3;
 
 	// public member functions
-	std::vector<T> GenerateDeck(size_t size);
-	std::vector<T> GetDeck() { return m_deck; }
+	Deck GenerateDeck(size_t size);
+	Deck GetDeck() { MaterializeDeck(); return m_deck; }
 	void ResetDeck();
 	void PerformShuffle(ShuffleType shuffle);
+
+	// the deck without copying it, valid until the next call that changes the deck
+	const T* GetDeckData() { MaterializeDeck(); return m_deck.data(); }
+	size_t GetDeckSize() const { return m_deckSize; }
+
+	// shuffle cards the caller owns in place, with this shuffler's mode and random number
+	// generator, the shuffler's own deck is left alone, the iterators have to be contiguous
+	void PerformShuffle(ShuffleType shuffle, T* pCards, size_t nCount);
+	template <class ContiguousIt>
+	void PerformShuffle(ShuffleType shuffle, ContiguousIt first, ContiguousIt last)
+	{
+		if (first != last)
+			PerformShuffle(shuffle, std::addressof(*first), (size_t)(last - first));
+	}
+
+#if defined(__cpp_lib_span)
+	std::span<const T> GetDeckView() { MaterializeDeck(); return std::span<const T>(m_deck.data(), m_deckSize); }
+	void PerformShuffle(ShuffleType shuffle, std::span<T> cards) { PerformShuffle(shuffle, cards.data(), cards.size()); }
+#endif
+	void PerformShuffles(ShuffleType shuffle, uint64_t k);
 	unsigned int RestoreDeck(ShuffleType shuffle);
+
+	// the same with the shuffle type known at compile time, the runtime versions above
+	// only pick one of these
+	template <ShuffleType S>
+	void PerformShuffle();
+	template <ShuffleType S>
+	unsigned int RestoreDeck();
+
+	static uint64_t RestoreDeckAnalytic(ShuffleType shuffle, size_t deckSize);
+	ShuffleMath::BigUInt RestoreDeckCycles(ShuffleType shuffle);
+	ShuffleMath::BigUInt RestoreDeckCycles(const std::vector<ShuffleType>& sequence);
 	bool IsDeckRestored();
+	void SetShuffleMode(ShuffleMode mode);
+	ShuffleMode GetShuffleMode() { return m_shuffleMode; }
+
+	// the random number generator, for replaying a run or handing out streams
+	// (see ShuffleRandom::Philox4x64::Stream) without touching the clock
+	URNG& GetRandomEngine() { return m_urng; }
+	void SetRandomEngine(const URNG& urng) { m_urng = urng; }
+
+	static constexpr bool IsRandomShuffle(ShuffleType shuffle)
+	{
+		return shuffle == ShuffleType::STL_SHUFFLE || shuffle == ShuffleType::FISHER_YATES ||
+			shuffle == ShuffleType::BUCKET_SHUFFLE || shuffle == ShuffleType::PARALLEL_SHUFFLE;
+	}
+
+	// random access queries, O(1) in LAZY mode while the deck has not been materialized,
+	// once it has FindCard searches the whole deck
+	T CardAt(size_t nPosition);
+	size_t FindCard(const T& card);		// returns the deck size when the card is not in the deck
+
+	// number of times the deck or the scratch memory had to grow, it stays the same
+	// across any number of shuffles once every shuffle type has run on the largest deck
+	uint64_t GetAllocationCount() const { return m_nAllocations; }
 
 private:
 	// deck of cards
-	std::vector<T> m_deck;
+	Deck m_deck;
 	bool m_bIsDeckOdd;
 	size_t m_deckSize;
 
@@ -46,79 +138,778 @@ private:
 	size_t m_SecondHalfIndex;
 	size_t m_MinVectorSize;
 
-	// Mersenne Twister algorithm for uniform random number generator
-	std::mt19937_64 m_urng;
+	// kernel used for the perfect shuffles
+	ShuffleMode m_shuffleMode;
+
+	// scratch memory kept between shuffles, cards for the copies of the deck and
+	// counts for the bucket offsets, both only reallocate when asked for more than
+	// they have ever held, in DOUBLE_BUFFER mode the cards are the deck's second buffer
+	Deck m_scratch;
+	std::vector<size_t, typename std::allocator_traits<Allocator>::template rebind_alloc<size_t>> m_scratchCounts;
+	uint64_t m_nAllocations;
+
+	// lazy deck, while a transform is pending position i (1-indexed) of the in shuffle
+	// range holds m_deck[offset + (i * multiplier mod 2n + 1) - 1], and the card at
+	// position j of m_deck moves to j * inverse, both kept in Montgomery form
+	bool m_bLazyPending;
+	bool m_bLazyBaseIdentity;		// m_deck still holds the distinct cards 0 .. n-1
+	size_t m_lazyOffset;
+	size_t m_lazyPairs;
+	ShuffleMath::Montgomery m_lazyMont;
+	uint64_t m_lazyMultiplier;
+	uint64_t m_lazyInverse;
+
+	// restore detection, the sentinels are the cards that sat at m_sentinelHome the last
+	// time the deck was known to be in order, and the perfect shuffles move them along
+	// with the deck, so the deck can only be restored again once all of them are home
+	static constexpr size_t SENTINEL_COUNT = 4;
+	size_t m_sentinelHome[SENTINEL_COUNT];
+	size_t m_sentinelPos[SENTINEL_COUNT];
+	bool m_bSentinelsValid;
+	bool m_bDistinctCards;
+
+	// uniform random number generator, Mersenne Twister by default
+	URNG m_urng;
 
 	// copy every nth item from a src vector into two destination vectors creating two halves
-	typename void copy_every_n(typename std::vector<T>::iterator srcVectorBegin, typename std::vector<T>::iterator srcVectorEnd, 
-							   typename std::vector<T>::iterator destVector1, typename std::vector<T>::iterator destVector2, const size_t n);
+	void copy_every_n(typename Deck::iterator srcVectorBegin, typename Deck::iterator srcVectorEnd, 
+							   typename Deck::iterator destVector1, typename Deck::iterator destVector2, const size_t n);
+
+	// the cards 0 .. size-1 in order, GenerateDeck without the copy
+	void BuildDeck(size_t size);
+
+	// scratch of exactly nCount cards (or counts), the contents are left over from earlier shuffles
+	T* GetScratch(size_t nCount);
+	size_t* GetScratchCounts(size_t nCount);
+
+	// the shuffled cards in the scratch become the deck and the old deck the scratch
+	void SwapScratchIntoDeck();
+
+	// every perfect shuffle is an in shuffle (or its inverse) of an even sized
+	// range of the deck, with the remaining end cards left unchanged
+	static void GetInShuffleRange(ShuffleType shuffleType, size_t deckSize, size_t& nOffset, size_t& nPairs);
+
+	// the VECTORIZED and REFERENCE perfect shuffles for one shuffle type and deck parity
+	template <ShuffleType S, bool bIsDeckOdd>
+	void PerformPerfectShuffle();
+
+	// interleave or deinterleave a copy of the in shuffle range straight back into the cards
+	void PerformShuffleVectorized(ShuffleType shuffleType, T* pCards, size_t nCount);
+
+	// read the deck once and write the shuffled deck once, into the other buffer
+	void PerformShuffleDoubleBuffer(ShuffleType shuffleType);
+
+	// the same as the vectorized kernels with every core writing its own block of the deck
+	void PerformShuffleParallel(ShuffleType shuffleType, T* pDeck, size_t nCount);
+
+	// in-place perfect shuffles, cycle leader or recursive depending on the mode
+	void PerformShuffleInPlace(ShuffleType shuffleType, T* pCards, size_t nCount);
+	static void InShuffleInPlace(T* pCards, size_t nPairs);
+	static void InvInShuffleInPlace(T* pCards, size_t nPairs);
+	static void InShuffleRecursive(T* pCards, size_t nPairs);
+	static void InvInShuffleRecursive(T* pCards, size_t nPairs);
+
+	// m_deck[nOffset + i - 1] = old m_deck[nOffset + (i * multiplier mod 2n + 1) - 1] for i = 1 .. 2n
+	void GatherRange(size_t nOffset, size_t nPairs, const ShuffleMath::Montgomery& mont, uint64_t nMultiplier);
+
+	// Fisher-Yates of nCount cards, with the swap targets prefetched a window ahead
+	// when the cards don't fit in cache
+	template <class Engine>
+	static void FisherYates(T* pCards, size_t nCount, Engine& urng);
+	template <class Engine>
+	static void FisherYatesPrefetch(T* pCards, size_t nCount, Engine& urng);
+
+	// random scatter into cache sized buckets, then Fisher-Yates inside each bucket
+	void BucketShuffle();
+	T* BucketShuffle(T* pCards, T* pScratch, size_t nCount);
+	void ParallelShuffle();
+	T* ParallelShuffle(T* pCards, T* pScratch, size_t nCount);
+
+	// calls onCard(i, bucket) for i = 0 .. nCount - 1 with a uniform bucket of nBucketBits bits
+	template <class Engine, class F>
+	static void DrawBuckets(Engine& urng, size_t nCount, int nBucketBits, F onCard);
+
+	// lazy deck
+	void LazyShuffle(ShuffleType shuffleType, uint64_t k);
+	void MaterializeDeck();
+
+	// restore detection
+	bool IsDeckIdentity();
+	void ResetSentinels();
+	void MoveSentinels(ShuffleType shuffleType, uint64_t k);
 };
 
-template<class T>
-CardShuffler<T>::CardShuffler()
+#if defined(__cpp_lib_memory_resource)
+// a shuffler whose deck and scratch come from a memory resource, a monotonic or pool
+// resource per thread keeps many shufflers off the global heap and its lock
+template <class T, class URNG = std::mt19937_64>
+using CardShufflerPmr = CardShuffler<T, URNG, std::pmr::polymorphic_allocator<T>>;
+#endif
+
+template<class T, class URNG, class Allocator>
+CardShuffler<T, URNG, Allocator>::CardShuffler()
+	: CardShuffler(Allocator())
 {
-	// init the Mersenne Twister random number generator
-	auto seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
-	m_urng = std::mt19937_64(seed);
+}
 
+// seeds the random number generator from the clock
+template<class T, class URNG, class Allocator>
+CardShuffler<T, URNG, Allocator>::CardShuffler(const Allocator& alloc)
+	: CardShuffler(URNG((uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count()), alloc)
+{
+}
+
+// the same seed always gives the same random shuffles
+template<class T, class URNG, class Allocator>
+CardShuffler<T, URNG, Allocator>::CardShuffler(uint64_t seed, const Allocator& alloc)
+	: CardShuffler(URNG(seed), alloc)
+{
+}
+
+// the deck and both scratch buffers share the allocator, which the bucket shuffles and
+// DOUBLE_BUFFER rely on when they swap the deck with the scratch
+template<class T, class URNG, class Allocator>
+CardShuffler<T, URNG, Allocator>::CardShuffler(const URNG& urng, const Allocator& alloc)
+	: m_deck(alloc), m_scratch(alloc), m_scratchCounts(alloc), m_urng(urng)
+{
 	m_bIsDeckOdd = false;
 	m_deckSize = 0;
-	m_deck = std::vector<T>();
 	m_FirstHalfIndex = 0;
 	m_SecondHalfIndex = 0;
 	m_MinVectorSize = 0;
+	m_shuffleMode = ShuffleMode::VECTORIZED;
+	m_nAllocations = 0;
+	m_bLazyPending = false;
+	m_bLazyBaseIdentity = false;
+	m_lazyOffset = 0;
+	m_lazyPairs = 0;
+	m_lazyMultiplier = 0;
+	m_lazyInverse = 0;
+	m_bSentinelsValid = false;
+	m_bDistinctCards = false;
+	std::fill(m_sentinelHome, m_sentinelHome + SENTINEL_COUNT, 0);
+	std::fill(m_sentinelPos, m_sentinelPos + SENTINEL_COUNT, 0);
 }
 
-template<class T>
-CardShuffler<T>::~CardShuffler()
+template<class T, class URNG, class Allocator>
+CardShuffler<T, URNG, Allocator>::~CardShuffler()
 {
 }
 
-template<class T>
-void CardShuffler<T>::ResetDeck()
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::ResetDeck()
 {
 	// get the current size of the deck
 	size_t nSize = m_deck.size();
 
-	// generate a new card deck with the original deck size	
-	GenerateDeck(nSize);
+	// generate a new card deck with the original deck size, without
+	// the copy of it that GenerateDeck returns
+	if (nSize >= MIN_DECK_SIZE)
+		BuildDeck(nSize);
 }
 
-template<class T>
-bool CardShuffler<T>::IsDeckRestored()
+template<class T, class URNG, class Allocator>
+bool CardShuffler<T, URNG, Allocator>::IsDeckRestored()
 {
+	// cheap test first, every sentinel card has to be back where it started
+	if (m_bSentinelsValid)
+	{
+		for (size_t i = 0; i < SENTINEL_COUNT; i++)
+		{
+			if (m_sentinelPos[i] != m_sentinelHome[i])
+				return false;
+		}
+	}
+
+	if (m_bLazyPending && m_lazyMultiplier != m_lazyMont.One())
+	{
+		// a generated deck that has been rearranged can't be in order
+		if (m_bLazyBaseIdentity)
+			return false;
+		MaterializeDeck();
+	}
+
 	// this assumes we're only using numbers instead of
 	// a "real deck" with suits and A, J, Q, K cards
-	return std::is_sorted(m_deck.begin(), m_deck.end());
+	// when the cards are the distinct 0 .. n-1 from GenerateDeck, being in
+	// order is the same as every card sitting at its own index
+	bool bRestored;
+	if (m_bDistinctCards && std::is_integral<T>::value)
+		bRestored = IsDeckIdentity();
+	else
+		bRestored = std::is_sorted(m_deck.begin(), m_deck.end());
+
+	// with distinct cards an ordered deck has every card home, so the sentinels can start over
+	if (bRestored && m_bDistinctCards)
+		ResetSentinels();
+	return bRestored;
+}
+
+// true when m_deck[i] == i for every card, stops at the first block that differs
+template<class T, class URNG, class Allocator>
+bool CardShuffler<T, URNG, Allocator>::IsDeckIdentity()
+{
+	if (m_deckSize * sizeof(T) <= ShuffleThreads::CACHE_SIZE_BYTES)
+		return ShuffleKernels::FindIotaMismatch(m_deck.data(), m_deckSize, 0) == m_deckSize;
+
+	// a deck that doesn't fit in cache is split across threads, each one checks
+	// its chunk in blocks so that it can give up once any thread finds a mismatch
+	const size_t nBlock = ShuffleThreads::MIN_CHUNK_SIZE;
+	const T* pDeck = m_deck.data();
+	std::atomic<bool> bMismatch(false);
+	ShuffleThreads::ParallelFor(m_deckSize, [=, &bMismatch](size_t nBegin, size_t nEnd)
+	{
+		for (size_t i = nBegin; i < nEnd && !bMismatch.load(std::memory_order_relaxed); i += nBlock)
+		{
+			size_t nCount = std::min(nBlock, nEnd - i);
+			if (ShuffleKernels::FindIotaMismatch(pDeck + i, nCount, i) != nCount)
+				bMismatch.store(true, std::memory_order_relaxed);
+		}
+	});
+	return !bMismatch.load();
+}
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::ResetSentinels()
+{
+	// spread out so that no single shuffle keeps all of them fixed
+	m_sentinelHome[0] = 1;
+	m_sentinelHome[1] = m_deckSize / 3;
+	m_sentinelHome[2] = m_deckSize / 2;
+	m_sentinelHome[3] = m_deckSize - 2;
+	std::copy(m_sentinelHome, m_sentinelHome + SENTINEL_COUNT, m_sentinelPos);
+	m_bSentinelsValid = true;
 }
 
-template<class T>
-std::vector<T> CardShuffler<T>::GenerateDeck(size_t size)
+// track the sentinels through k shuffles, O(1) for the perfect shuffles
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::MoveSentinels(ShuffleType shuffleType, uint64_t k)
+{
+	if (!m_bSentinelsValid || k == 0)
+		return;
+
+	if (IsRandomShuffle(shuffleType))
+	{
+		// lost track of them until the next full check finds the deck in order
+		m_bSentinelsValid = false;
+		return;
+	}
+
+	// position j (1-indexed) of the in shuffle range moves to 2^k * j mod 2n + 1,
+	// or 2^-k * j for the inverse shuffles
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, m_deckSize, nOffset, nPairs);
+	const uint64_t nModulus = 2 * (uint64_t)nPairs + 1;
+	const bool bForward = (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE);
+
+	ShuffleMath::Montgomery mont;
+	uint64_t nMultiplier = 0;
+	if (k > 1)
+	{
+		mont = ShuffleMath::Montgomery(nModulus);
+		nMultiplier = mont.Pow(bForward ? mont.To(2) : mont.Halve(mont.One()), k);
+	}
+
+	for (size_t i = 0; i < SENTINEL_COUNT; i++)
+	{
+		size_t& nPos = m_sentinelPos[i];
+		if (nPos < nOffset || nPos >= nOffset + 2 * nPairs)
+			continue;
+
+		uint64_t j = nPos - nOffset + 1;
+		if (k > 1)
+			j = mont.From(mont.Mul(mont.To(j), nMultiplier));
+		else if (bForward)
+			j = (j >= nModulus - j) ? (j - (nModulus - j)) : (j + j);
+		else
+			j = (j % 2 == 0) ? (j / 2) : (j / 2 + nModulus / 2 + 1);
+		nPos = nOffset + (size_t)j - 1;
+	}
+}
+
+template<class T, class URNG, class Allocator>
+typename CardShuffler<T, URNG, Allocator>::Deck CardShuffler<T, URNG, Allocator>::GenerateDeck(size_t size)
 {
 	// return an empty vector for an invalid size
 	if (size < MIN_DECK_SIZE)
-		return std::vector<T>();
+		return Deck(m_deck.get_allocator());
+
+	BuildDeck(size);
+	return m_deck;
+}
 
-	// swap using Scott Meyer's trick to clear out the 
-	// existing vector with an empty vector
-	std::vector<T>().swap(m_deck);
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::BuildDeck(size_t size)
+{
+	// clear keeps the capacity, so a deck no bigger than the last one reuses its memory
+	m_deck.clear();
 
 	// using reserve and push_back is slightly faster
 	// https://lemire.me/blog/2012/06/20/do-not-waste-time-with-stl-vectors/
-	m_deck = std::vector<T>();
-	m_deck.reserve(size);
+	if (size > m_deck.capacity())
+	{
+		m_deck.reserve(size);
+		m_nAllocations++;
+	}
 	m_deckSize = size;
-	for (unsigned int i = 0; i < size; i++)
-		m_deck.push_back(i);
+	for (size_t i = 0; i < size; i++)
+		m_deck.push_back((T)i);
 
 	// flag to indicate if the deck contains an odd or even number of items
 	m_bIsDeckOdd = (size % 2) == 1;
-	return m_deck;
+
+	// a new deck drops any pending lazy transform
+	m_bLazyPending = false;
+	m_bLazyBaseIdentity = ((size_t)(T)(size - 1) == size - 1);
+
+	// the generated deck is in order, so the sentinels start at home
+	m_bDistinctCards = m_bLazyBaseIdentity;
+	m_bSentinelsValid = false;
+	if (m_bDistinctCards)
+		ResetSentinels();
+}
+
+// applies the same shuffle k times, for the perfect shuffles this is a single pass over the
+// deck regardless of k since k in shuffles send position j to 2^k * j mod (2n + 1)
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffles(ShuffleType shuffleType, uint64_t k)
+{
+	if (IsRandomShuffle(shuffleType))
+	{
+		for (uint64_t i = 0; i < k; i++)
+			PerformShuffle(shuffleType);
+		return;
+	}
+
+	if (k == 0 || m_deckSize < MIN_DECK_SIZE)
+		return;
+
+	MoveSentinels(shuffleType, k);
+
+	if (m_shuffleMode == ShuffleMode::LAZY)
+	{
+		LazyShuffle(shuffleType, k);
+		return;
+	}
+
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, m_deckSize, nOffset, nPairs);
+
+	// the card that ends up at position i (1-indexed) of the range started at i * 2^-k,
+	// for the inverse shuffles it started at i * 2^k
+	const uint64_t nModulus = 2 * (uint64_t)nPairs + 1;
+	ShuffleMath::Montgomery mont(nModulus);
+	uint64_t nMultiplier;
+	if (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE)
+		nMultiplier = mont.Pow(mont.To((nModulus + 1) / 2), k);
+	else
+		nMultiplier = mont.Pow(mont.To(2), k);
+
+	GatherRange(nOffset, nPairs, mont, nMultiplier);
+	m_bLazyBaseIdentity = false;
+}
+
+// resizing within the capacity never reallocates, growing it reserves at least the
+// whole deck so the largest scratch any shuffle asks for is allocated once
+template<class T, class URNG, class Allocator>
+T* CardShuffler<T, URNG, Allocator>::GetScratch(size_t nCount)
+{
+	if (nCount > m_scratch.capacity())
+	{
+		m_scratch.reserve(std::max(nCount, m_deckSize));
+		m_nAllocations++;
+	}
+	m_scratch.resize(nCount);
+	return m_scratch.data();
+}
+
+template<class T, class URNG, class Allocator>
+size_t* CardShuffler<T, URNG, Allocator>::GetScratchCounts(size_t nCount)
+{
+	if (nCount > m_scratchCounts.capacity())
+	{
+		m_scratchCounts.reserve(nCount);
+		m_nAllocations++;
+	}
+	m_scratchCounts.resize(nCount);
+	return m_scratchCounts.data();
+}
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::SwapScratchIntoDeck()
+{
+	// the scratch has to have been asked for exactly m_deckSize cards so that swapping leaves
+	// both the same size, the vectors only trade pointers so neither buffer is freed
+	m_deck.swap(m_scratch);
+}
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::GatherRange(size_t nOffset, size_t nPairs, const ShuffleMath::Montgomery& mont, uint64_t nMultiplier)
+{
+	const uint64_t nModulus = mont.Modulus();
+	const uint64_t nStep = mont.From(nMultiplier);
+
+	// gather into the other buffer and swap it in, each thread writes its own contiguous
+	// chunk, the cards outside the range are the only ones copied as they are
+	const T* pDeck = m_deck.data();
+	T* pOut = GetScratch(m_deckSize);
+	std::copy(pDeck, pDeck + nOffset, pOut);
+	std::copy(pDeck + nOffset + 2 * nPairs, pDeck + m_deckSize, pOut + nOffset + 2 * nPairs);
+
+	T* pRange = pOut + nOffset;
+	const T* pCards = pDeck + nOffset;
+	ShuffleThreads::ParallelFor(2 * nPairs, [=, &mont](size_t nBegin, size_t nEnd)
+	{
+		uint64_t nSource = mont.From(mont.Mul(mont.To(nBegin + 1), nMultiplier));
+		for (size_t i = nBegin; i < nEnd; i++)
+		{
+			pRange[i] = pCards[nSource - 1];
+			nSource = (nSource >= nModulus - nStep) ? (nSource - (nModulus - nStep)) : (nSource + nStep);
+		}
+	});
+	SwapScratchIntoDeck();
+}
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::SetShuffleMode(ShuffleMode mode)
+{
+	// the other modes work on the real deck
+	if (mode != ShuffleMode::LAZY)
+		MaterializeDeck();
+	m_shuffleMode = mode;
+}
+
+// fold k perfect shuffles into the pending transform
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::LazyShuffle(ShuffleType shuffleType, uint64_t k)
+{
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, m_deckSize, nOffset, nPairs);
+
+	// in and out shuffles work on different ranges, so switching between
+	// them can't be expressed by a single transform
+	if (m_bLazyPending && (nOffset != m_lazyOffset || nPairs != m_lazyPairs))
+		MaterializeDeck();
+
+	if (!m_bLazyPending)
+	{
+		const uint64_t nModulus = 2 * (uint64_t)nPairs + 1;
+		if (m_lazyMont.Modulus() != nModulus)
+			m_lazyMont = ShuffleMath::Montgomery(nModulus);
+		m_lazyOffset = nOffset;
+		m_lazyPairs = nPairs;
+		m_lazyMultiplier = m_lazyMont.One();
+		m_lazyInverse = m_lazyMultiplier;
+		m_bLazyPending = true;
+	}
+
+	// a shuffle moves the card at j to 2j, so the source multiplier is halved
+	// and the inverse doubled, the inverse shuffles do the opposite
+	uint64_t nHalf, nDouble;
+	if (k == 1)
+	{
+		nHalf = m_lazyMont.Halve(m_lazyMont.One());
+		nDouble = m_lazyMont.To(2);
+	}
+	else
+	{
+		nHalf = m_lazyMont.Pow(m_lazyMont.Halve(m_lazyMont.One()), k);
+		nDouble = m_lazyMont.Pow(m_lazyMont.To(2), k);
+	}
+
+	if (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE)
+	{
+		m_lazyMultiplier = m_lazyMont.Mul(m_lazyMultiplier, nHalf);
+		m_lazyInverse = m_lazyMont.Mul(m_lazyInverse, nDouble);
+	}
+	else
+	{
+		m_lazyMultiplier = m_lazyMont.Mul(m_lazyMultiplier, nDouble);
+		m_lazyInverse = m_lazyMont.Mul(m_lazyInverse, nHalf);
+	}
+}
+
+// apply the pending lazy transform to m_deck
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::MaterializeDeck()
+{
+	if (!m_bLazyPending)
+		return;
+
+	m_bLazyPending = false;
+	if (m_lazyMultiplier == m_lazyMont.One())
+		return;
+
+	GatherRange(m_lazyOffset, m_lazyPairs, m_lazyMont, m_lazyMultiplier);
+	m_bLazyBaseIdentity = false;
+}
+
+template<class T, class URNG, class Allocator>
+T CardShuffler<T, URNG, Allocator>::CardAt(size_t nPosition)
+{
+	if (m_bLazyPending && nPosition >= m_lazyOffset && nPosition < m_lazyOffset + 2 * m_lazyPairs)
+	{
+		uint64_t nSource = m_lazyMont.From(m_lazyMont.Mul(m_lazyMont.To(nPosition - m_lazyOffset + 1), m_lazyMultiplier));
+		return m_deck[m_lazyOffset + nSource - 1];
+	}
+	return m_deck[nPosition];
+}
+
+template<class T, class URNG, class Allocator>
+size_t CardShuffler<T, URNG, Allocator>::FindCard(const T& card)
+{
+	// find the card in m_deck, a generated deck holds card i at index i, any other
+	// deck (such as one LazyShuffle materialized) has to be searched
+	size_t nBase = m_deckSize;
+	if (m_bLazyBaseIdentity && (size_t)card < m_deckSize && m_deck[(size_t)card] == card)
+		nBase = (size_t)card;
+	else
+		nBase = std::find(m_deck.begin(), m_deck.end(), card) - m_deck.begin();
+
+	// then move it with the pending transform
+	if (m_bLazyPending && nBase >= m_lazyOffset && nBase < m_lazyOffset + 2 * m_lazyPairs)
+	{
+		uint64_t nTarget = m_lazyMont.From(m_lazyMont.Mul(m_lazyMont.To(nBase - m_lazyOffset + 1), m_lazyInverse));
+		return m_lazyOffset + nTarget - 1;
+	}
+	return nBase;
+}
+
+template<class T, class URNG, class Allocator>
+template<class Engine>
+void CardShuffler<T, URNG, Allocator>::FisherYates(T* pCards, size_t nCount, Engine& urng)
+{
+	if (nCount < 2)
+		return;
+
+	// cards that don't fit in cache miss on almost every swap
+	if (nCount * sizeof(T) > ShuffleThreads::CACHE_SIZE_BYTES)
+	{
+		FisherYatesPrefetch(pCards, nCount, urng);
+		return;
+	}
+
+	// standard Fisher-Yates shuffle algorithm, swapping card i with a random card in 0 .. i
+	ShuffleRandom::FisherYatesIndices<Engine> swapIndeces(urng, nCount);
+	for (size_t i = nCount - 1; i > 0; --i)
+		std::swap(pCards[i], pCards[swapIndeces.Next()]);
+}
+
+// same permutation as the plain Fisher-Yates loop for the same random engine state, the swap
+// indeces are drawn a window ahead into a ring buffer and their cards prefetched, so by the
+// time a swap happens its cache line should have arrived from memory
+template<class T, class URNG, class Allocator>
+template<class Engine>
+void CardShuffler<T, URNG, Allocator>::FisherYatesPrefetch(T* pCards, size_t nCount, Engine& urng)
+{
+	const size_t WINDOW = 16;
+	const size_t nSwaps = nCount - 1;
+	ShuffleRandom::FisherYatesIndices<Engine> swapIndeces(urng, nCount);
+
+	size_t ring[WINDOW];
+	for (size_t k = 0; k < WINDOW && k < nSwaps; k++)
+	{
+		ring[k] = swapIndeces.Next();
+		ShuffleKernels::Prefetch(pCards + ring[k]);
+	}
+
+	// swap k is for card n-1-k, its slot is refilled with the index for swap k + WINDOW
+	for (size_t k = 0; k < nSwaps; k++)
+	{
+		const size_t nSlot = k % WINDOW;
+		const size_t swapIndex = ring[nSlot];
+		if (k + WINDOW < nSwaps)
+		{
+			ring[nSlot] = swapIndeces.Next();
+			ShuffleKernels::Prefetch(pCards + ring[nSlot]);
+		}
+		std::swap(pCards[nSwaps - k], pCards[swapIndex]);
+	}
+}
+
+// Rao-Sandelius shuffle, every card goes to a bucket picked uniformly at random, then each
+// bucket is shuffled on its own and the buckets are laid end to end, which gives a uniform
+// permutation, buckets that are still bigger than L2 are split again the same way, so
+// the only random access is a scatter into a few dozen sequential write streams
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::BucketShuffle()
+{
+	T* pScratch = GetScratch(m_deckSize);
+	if (BucketShuffle(m_deck.data(), pScratch, m_deckSize) != m_deck.data())
+		SwapScratchIntoDeck();
+}
+
+// shuffles nCount cards from pCards using pScratch, returns whichever of the two holds the result
+template<class T, class URNG, class Allocator>
+T* CardShuffler<T, URNG, Allocator>::BucketShuffle(T* pCards, T* pScratch, size_t nCount)
+{
+	// a power of two bucket count lets each bucket be a few bits of a 64 bit draw, with no bias,
+	// and more than 64 write streams at once start to thrash the TLB
+	const int MAX_BUCKET_BITS = 6;
+	const size_t nBytes = nCount * sizeof(T);
+	int nBucketBits = 0;
+	while (nBucketBits < MAX_BUCKET_BITS && (ShuffleThreads::BLOCK_SIZE_BYTES << nBucketBits) < nBytes)
+		nBucketBits++;
+
+	if (nBucketBits == 0)
+	{
+		FisherYates(pCards, nCount, m_urng);
+		return pCards;
+	}
+
+	// the buckets are drawn twice, once to count them and once to scatter,
+	// from two copies of the same engine so that nothing has to be stored
+	const size_t nBuckets = (size_t)1 << nBucketBits;
+
+	// first pass, count the cards in each bucket, the counts live on the stack since
+	// every level of the recursion needs its own
+	size_t bucketStart[(1 << MAX_BUCKET_BITS) + 1] = {};
+	URNG replay = m_urng;
+	DrawBuckets(replay, nCount, nBucketBits, [&](size_t, size_t nBucket) { bucketStart[nBucket + 1]++; });
+	for (size_t b = 0; b < nBuckets; b++)
+		bucketStart[b + 1] += bucketStart[b];
+
+	// second pass, scatter the cards into their buckets
+	size_t bucketNext[1 << MAX_BUCKET_BITS];
+	std::copy(bucketStart, bucketStart + nBuckets, bucketNext);
+	DrawBuckets(m_urng, nCount, nBucketBits, [&](size_t i, size_t nBucket) { pScratch[bucketNext[nBucket]++] = pCards[i]; });
+
+	// then shuffle each bucket, the ones that had to be split again may end up back in pCards
+	for (size_t b = 0; b < nBuckets; b++)
+	{
+		const size_t nStart = bucketStart[b], nSize = bucketStart[b + 1] - nStart;
+		T* pResult = BucketShuffle(pScratch + nStart, pCards + nStart, nSize);
+		if (pResult != pScratch + nStart)
+			std::copy(pResult, pResult + nSize, pScratch + nStart);
+	}
+	return pScratch;
+}
+
+template<class T, class URNG, class Allocator>
+template<class Engine, class F>
+void CardShuffler<T, URNG, Allocator>::DrawBuckets(Engine& urng, size_t nCount, int nBucketBits, F onCard)
+{
+	ShuffleRandom::BoundedRandom<Engine> random(urng);
+	uint64_t bits = 0;
+	int nBitsLeft = 0;
+	for (size_t i = 0; i < nCount; i++)
+	{
+		if (nBitsLeft < nBucketBits)
+		{
+			bits = random.Next64();
+			nBitsLeft = 64;
+		}
+		onCard(i, (size_t)(bits >> (64 - nBucketBits)));
+		bits <<= nBucketBits;
+		nBitsLeft -= nBucketBits;
+	}
+}
+
+// parallel Rao-Sandelius shuffle (Sanders, "Random Permutations on Distributed, External
+// and Hierarchical Memory", 1998), the deck is cut into chunks that each draw the buckets
+// of their cards from their own Philox stream, then every bucket is shuffled from its own
+// stream, the chunks and buckets only depend on the deck size and the streams only on one
+// draw from m_urng, so a seeded shuffler gives the same deck with any number of threads
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::ParallelShuffle()
+{
+	T* pScratch = GetScratch(m_deckSize);
+	if (ParallelShuffle(m_deck.data(), pScratch, m_deckSize) != m_deck.data())
+		SwapScratchIntoDeck();
+}
+
+// shuffles nCount cards from pCards using pScratch, returns whichever of the two holds the result
+template<class T, class URNG, class Allocator>
+T* CardShuffler<T, URNG, Allocator>::ParallelShuffle(T* pCards, T* pScratch, size_t nCount)
+{
+	const uint64_t seed = ShuffleRandom::BoundedRandom<URNG>(m_urng).Next64();
+	const uint64_t BUCKET_STREAMS = 1ull << 32;
+
+	const size_t MAX_CHUNKS = 256;
+	const size_t nChunks = std::max<size_t>(1, std::min(MAX_CHUNKS, nCount / ShuffleThreads::MIN_CHUNK_SIZE));
+
+	const int MAX_BUCKET_BITS = 10;
+	const size_t nBytes = nCount * sizeof(T);
+	int nBucketBits = 0;
+	while (nBucketBits < MAX_BUCKET_BITS && (ShuffleThreads::BLOCK_SIZE_BYTES << nBucketBits) < nBytes)
+		nBucketBits++;
+	const size_t nBuckets = (size_t)1 << nBucketBits;
+
+	if (nBucketBits == 0)
+	{
+		ShuffleRandom::Philox4x64 urng(seed, BUCKET_STREAMS);
+		FisherYates(pCards, nCount, urng);
+		return pCards;
+	}
+
+	auto chunkBegin = [=](size_t c) { return nCount * c / nChunks; };
+
+	// count the cards each chunk sends to each bucket
+	size_t* offsets = GetScratchCounts(nChunks * nBuckets + nBuckets + 1);
+	size_t* bucketStart = offsets + nChunks * nBuckets;
+	std::fill(offsets, offsets + nChunks * nBuckets, 0);
+	ShuffleThreads::ParallelForEach(nChunks, [&](size_t c)
+	{
+		ShuffleRandom::Philox4x64 urng(seed, c);
+		size_t* pCounts = offsets + c * nBuckets;
+		DrawBuckets(urng, chunkBegin(c + 1) - chunkBegin(c), nBucketBits, [=](size_t, size_t nBucket) { pCounts[nBucket]++; });
+	});
+
+	// bucket b is laid out chunk by chunk, turn the counts into where each chunk writes
+	size_t nRunning = 0;
+	for (size_t b = 0; b < nBuckets; b++)
+	{
+		bucketStart[b] = nRunning;
+		for (size_t c = 0; c < nChunks; c++)
+		{
+			size_t nChunkCount = offsets[c * nBuckets + b];
+			offsets[c * nBuckets + b] = nRunning;
+			nRunning += nChunkCount;
+		}
+	}
+	bucketStart[nBuckets] = nRunning;
+
+	// replay the same streams to scatter the cards, every chunk writes its own slots
+	T* pBuckets = pScratch;
+	const T* pDeck = pCards;
+	ShuffleThreads::ParallelForEach(nChunks, [&](size_t c)
+	{
+		ShuffleRandom::Philox4x64 urng(seed, c);
+		size_t* pNext = offsets + c * nBuckets;
+		const T* pChunk = pDeck + chunkBegin(c);
+		DrawBuckets(urng, chunkBegin(c + 1) - chunkBegin(c), nBucketBits, [=](size_t i, size_t nBucket) { pBuckets[pNext[nBucket]++] = pChunk[i]; });
+	});
+
+	// shuffle the buckets
+	ShuffleThreads::ParallelForEach(nBuckets, [&](size_t b)
+	{
+		ShuffleRandom::Philox4x64 urng(seed, BUCKET_STREAMS + b);
+		FisherYates(pBuckets + bucketStart[b], bucketStart[b + 1] - bucketStart[b], urng);
+	});
+	return pScratch;
 }
 
 // returns number of shuffles to restore a deck with a given shuffle type
-template<class T>
-unsigned int CardShuffler<T>::RestoreDeck(ShuffleType shuffle)
+template<class T, class URNG, class Allocator>
+unsigned int CardShuffler<T, URNG, Allocator>::RestoreDeck(ShuffleType shuffle)
+{
+	switch (shuffle)
+	{
+		case ShuffleType::STL_SHUFFLE:		return RestoreDeck<ShuffleType::STL_SHUFFLE>();
+		case ShuffleType::FISHER_YATES:		return RestoreDeck<ShuffleType::FISHER_YATES>();
+		case ShuffleType::OUTSHUFFLE:		return RestoreDeck<ShuffleType::OUTSHUFFLE>();
+		case ShuffleType::INSHUFFLE:		return RestoreDeck<ShuffleType::INSHUFFLE>();
+		case ShuffleType::INV_OUTSHUFFLE:	return RestoreDeck<ShuffleType::INV_OUTSHUFFLE>();
+		case ShuffleType::INV_INSHUFFLE:	return RestoreDeck<ShuffleType::INV_INSHUFFLE>();
+		case ShuffleType::BUCKET_SHUFFLE:	return RestoreDeck<ShuffleType::BUCKET_SHUFFLE>();
+		case ShuffleType::PARALLEL_SHUFFLE:	return RestoreDeck<ShuffleType::PARALLEL_SHUFFLE>();
+	}
+	return 0;
+}
+
+template<class T, class URNG, class Allocator>
+template<ShuffleType S>
+unsigned int CardShuffler<T, URNG, Allocator>::RestoreDeck()
 {
 	unsigned int nShuffles = 0;
 
@@ -126,19 +917,113 @@ unsigned int CardShuffler<T>::RestoreDeck(ShuffleType shuffle)
 	do
 	{
 		nShuffles++;
-		PerformShuffle(shuffle);
+		PerformShuffle<S>();
 	} while (IsDeckRestored() == false);
 
 	// return number of shuffles to restore a deck
 	return nShuffles;
 }
 
+// returns number of shuffles to restore a deck of the given size without shuffling one,
+// or 0 for the random shuffle types
+template<class T, class URNG, class Allocator>
+uint64_t CardShuffler<T, URNG, Allocator>::RestoreDeckAnalytic(ShuffleType shuffle, size_t deckSize)
+{
+	if (deckSize < MIN_DECK_SIZE)
+		return 0;
+
+	switch (shuffle)
+	{
+		case ShuffleType::OUTSHUFFLE:
+		case ShuffleType::INSHUFFLE:
+		case ShuffleType::INV_OUTSHUFFLE:
+		case ShuffleType::INV_INSHUFFLE:
+		{
+			// an in shuffle of 2n cards sends position j to 2j mod (2n + 1) (1-indexed),
+			// so it and its inverse restore the deck after the order of 2 mod 2n + 1
+			//   Out, n odd  = ord(2) mod n
+			//   Out, n even = ord(2) mod n - 1
+			//    In, n odd  = ord(2) mod n
+			//    In, n even = ord(2) mod n + 1
+			size_t nOffset, nPairs;
+			GetInShuffleRange(shuffle, deckSize, nOffset, nPairs);
+			return ShuffleMath::MultiplicativeOrderOf2(2 * (uint64_t)nPairs + 1);
+		}
+
+		default:
+			return 0;
+	}
+}
+
+template<class T, class URNG, class Allocator>
+ShuffleMath::BigUInt CardShuffler<T, URNG, Allocator>::RestoreDeckCycles(ShuffleType shuffle)
+{
+	return RestoreDeckCycles(std::vector<ShuffleType>(1, shuffle));
+}
+
+// returns number of times a sequence of deterministic shuffles has to be repeated to
+// restore the deck, this is the lcm of the cycle lengths of the permutation it applies,
+// or 0 if the sequence contains a random shuffle type
+template<class T, class URNG, class Allocator>
+ShuffleMath::BigUInt CardShuffler<T, URNG, Allocator>::RestoreDeckCycles(const std::vector<ShuffleType>& sequence)
+{
+	for (ShuffleType shuffle : sequence)
+	{
+		if (IsRandomShuffle(shuffle))
+			return ShuffleMath::BigUInt(0);
+	}
+	if (m_deckSize < MIN_DECK_SIZE)
+		return ShuffleMath::BigUInt(0);
+
+	// the temporaries come from the deck's allocator too, a deck on huge pages or in a
+	// memory resource shouldn't have its cycles counted in memory from operator new
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<size_t> PositionAllocator;
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<bool> VisitedAllocator;
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<uint64_t> LengthAllocator;
+	const Allocator alloc = m_deck.get_allocator();
+
+	// apply the sequence once to a deck of positions, the current deck is left alone,
+	// the seed doesn't matter as the sequence only has deterministic shuffles
+	CardShuffler<size_t, URNG, PositionAllocator> identity((uint64_t)0, PositionAllocator(alloc));
+	identity.SetShuffleMode(m_shuffleMode);
+	identity.GenerateDeck(m_deckSize);
+	for (ShuffleType shuffle : sequence)
+		identity.PerformShuffle(shuffle);
+	const size_t* permutation = identity.GetDeckData();
+
+	// walk every cycle once, marking the positions visited
+	std::vector<bool, VisitedAllocator> visited(m_deckSize, false, VisitedAllocator(alloc));
+	std::vector<uint64_t, LengthAllocator> cycleLengths{ LengthAllocator(alloc) };
+	for (size_t nStart = 0; nStart < m_deckSize; nStart++)
+	{
+		if (visited[nStart])
+			continue;
+
+		uint64_t nLength = 0;
+		for (size_t j = nStart; !visited[j]; j = permutation[j])
+		{
+			visited[j] = true;
+			nLength++;
+		}
+		cycleLengths.push_back(nLength);
+	}
+
+	// there are only O(sqrt(n)) distinct cycle lengths
+	std::sort(cycleLengths.begin(), cycleLengths.end());
+	cycleLengths.erase(std::unique(cycleLengths.begin(), cycleLengths.end()), cycleLengths.end());
+
+	ShuffleMath::BigUInt nShuffles(1);
+	for (uint64_t nLength : cycleLengths)
+		nShuffles.Lcm(nLength);
+	return nShuffles;
+}
+
 // copy every nth element from a vector into two destination vectors, modified from this link
 //https://stackoverflow.com/questions/30817563/copy-every-other-element-using-standard-algorithms-downsampling
 
-template<class T>
-typename void CardShuffler<T>::copy_every_n(typename std::vector<T>::iterator srcBegin, typename std::vector<T>::iterator srcEnd, 
-											typename std::vector<T>::iterator destVector1, typename std::vector<T>::iterator destVector2, const size_t n)
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::copy_every_n(typename Deck::iterator srcBegin, typename Deck::iterator srcEnd, 
+											typename Deck::iterator destVector1, typename Deck::iterator destVector2, const size_t n)
 {
 	// increment by the value n specified
 	//const size_t nIncrement = n;
@@ -154,180 +1039,556 @@ typename void CardShuffler<T>::copy_every_n(typename std::vector<T>::iterator sr
 	}
 }
 
-template<class T>
-void CardShuffler<T>::PerformShuffle(ShuffleType shuffleType)
+// runtime dispatch onto the compile time specializations
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffle(ShuffleType shuffleType)
 {
-	//size_t uDeckSize = m_deck.size();
-	//if (uDeckSize < 2)
-	//	return;
+	switch (shuffleType)
+	{
+		case ShuffleType::STL_SHUFFLE:		PerformShuffle<ShuffleType::STL_SHUFFLE>(); break;
+		case ShuffleType::FISHER_YATES:		PerformShuffle<ShuffleType::FISHER_YATES>(); break;
+		case ShuffleType::OUTSHUFFLE:		PerformShuffle<ShuffleType::OUTSHUFFLE>(); break;
+		case ShuffleType::INSHUFFLE:		PerformShuffle<ShuffleType::INSHUFFLE>(); break;
+		case ShuffleType::INV_OUTSHUFFLE:	PerformShuffle<ShuffleType::INV_OUTSHUFFLE>(); break;
+		case ShuffleType::INV_INSHUFFLE:	PerformShuffle<ShuffleType::INV_INSHUFFLE>(); break;
+		case ShuffleType::BUCKET_SHUFFLE:	PerformShuffle<ShuffleType::BUCKET_SHUFFLE>(); break;
+		case ShuffleType::PARALLEL_SHUFFLE:	PerformShuffle<ShuffleType::PARALLEL_SHUFFLE>(); break;
+	}
+}
 
-	size_t nIndex = 0;
+// the same kernels on cards the caller owns, they can't be swapped with the scratch
+// so the shuffles that end up there copy the result back
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffle(ShuffleType shuffleType, T* pCards, size_t nCount)
+{
+	if (nCount < MIN_DECK_SIZE)
+		return;
 
 	switch (shuffleType)
 	{
 		case ShuffleType::STL_SHUFFLE:
+			std::shuffle(pCards, pCards + nCount, m_urng);
+			return;
+
+		case ShuffleType::FISHER_YATES:
+			FisherYates(pCards, nCount, m_urng);
+			return;
+
+		case ShuffleType::BUCKET_SHUFFLE:
+		case ShuffleType::PARALLEL_SHUFFLE:
 		{
-			// use the standard STL shuffle the deck using the random number generator
-			std::shuffle(m_deck.begin(), m_deck.end(), m_urng);
+			T* pScratch = GetScratch(nCount);
+			T* pResult = (shuffleType == ShuffleType::BUCKET_SHUFFLE) ? BucketShuffle(pCards, pScratch, nCount) : ParallelShuffle(pCards, pScratch, nCount);
+			if (pResult != pCards)
+				std::copy(pResult, pResult + nCount, pCards);
+			return;
+		}
+
+		default:
+			break;
+	}
+
+	switch (m_shuffleMode)
+	{
+		case ShuffleMode::IN_PLACE:
+		case ShuffleMode::RECURSIVE:
+			PerformShuffleInPlace(shuffleType, pCards, nCount);
+			break;
+
+		case ShuffleMode::PARALLEL:
+			PerformShuffleParallel(shuffleType, pCards, nCount);
 			break;
+
+		// LAZY and DOUBLE_BUFFER need the deck to be their own, and REFERENCE gives the same cards
+		default:
+			PerformShuffleVectorized(shuffleType, pCards, nCount);
+			break;
+	}
+}
+
+// one shuffle type with every choice that depends on it made at compile time
+template<class T, class URNG, class Allocator>
+template<ShuffleType S>
+void CardShuffler<T, URNG, Allocator>::PerformShuffle()
+{
+	// nothing to shuffle until GenerateDeck has been called
+	if (m_deckSize < MIN_DECK_SIZE)
+		return;
+
+	MoveSentinels(S, 1);
+
+	if (m_shuffleMode == ShuffleMode::LAZY)
+	{
+		if constexpr (!IsRandomShuffle(S))
+		{
+			LazyShuffle(S, 1);
+			return;
 		}
 
-		case ShuffleType::FISHER_YATES:
+		// a random shuffle needs the real deck
+		MaterializeDeck();
+	}
+	m_bLazyBaseIdentity = false;
+
+	if constexpr (S == ShuffleType::STL_SHUFFLE)
+	{
+		// use the standard STL shuffle the deck using the random number generator
+		std::shuffle(m_deck.begin(), m_deck.end(), m_urng);
+	}
+	else if constexpr (S == ShuffleType::FISHER_YATES)
+	{
+		FisherYates(m_deck.data(), m_deckSize, m_urng);
+	}
+	else if constexpr (S == ShuffleType::PARALLEL_SHUFFLE)
+	{
+		ParallelShuffle();
+	}
+	else if constexpr (S == ShuffleType::BUCKET_SHUFFLE)
+	{
+		BucketShuffle();
+	}
+	else
+	{
+		switch (m_shuffleMode)
+		{
+			case ShuffleMode::IN_PLACE:
+			case ShuffleMode::RECURSIVE:
+				PerformShuffleInPlace(S, m_deck.data(), m_deckSize);
+				break;
+
+			case ShuffleMode::PARALLEL:
+				PerformShuffleParallel(S, m_deck.data(), m_deckSize);
+				break;
+
+			case ShuffleMode::DOUBLE_BUFFER:
+				PerformShuffleDoubleBuffer(S);
+				break;
+
+			default:
+				// odd and even decks get kernels of their own
+				if (m_bIsDeckOdd)
+					PerformPerfectShuffle<S, true>();
+				else
+					PerformPerfectShuffle<S, false>();
+				break;
+		}
+	}
+}
+
+// the VECTORIZED and REFERENCE kernels, with the shuffle type and the parity of the deck fixed
+template<class T, class URNG, class Allocator>
+template<ShuffleType S, bool bIsDeckOdd>
+void CardShuffler<T, URNG, Allocator>::PerformPerfectShuffle()
+{
+	// the vectorized kernel only copies the in shuffle range, the rest is the reference
+	if (m_shuffleMode == ShuffleMode::VECTORIZED)
+	{
+		PerformShuffleVectorized(S, m_deck.data(), m_deckSize);
+		return;
+	}
+
+	// For the inverse outshuffle and inverse inshuffle
+	if constexpr (S == ShuffleType::INV_INSHUFFLE || S == ShuffleType::INV_OUTSHUFFLE)
+	{
+		// calculate the two halves of the deck, and assign them accordingly
+		// based on odd/even, which will change the number of cards to use for each half
+		// https://www.techiedelight.com/split-array-two-parts-java/
+		size_t half1, half2;
+		if constexpr (bIsDeckOdd)
+			half1 = (m_deckSize / 2);
+		else
+			half1 = ((m_deckSize + 1) / 2);
+
+		// calc second half size, then take the minimum of 
+		// the two numbers for interleaving cards
+		half2 = (m_deckSize - half1);
+		size_t minSize = min(half1, half2);
+
+		// the two halves of the deck, side by side in the scratch
+		GetScratch(2 * minSize);
+		typename Deck::iterator vecFirstHalf = m_scratch.begin();
+		typename Deck::iterator vecSecondHalf = m_scratch.begin() + minSize;
+
+		/*
+
+		basic algorithm for inverse in and inverse out shuffles and interleaving the cards
+		1) if the size of the deck (n) is even (inverse in OR inverse out shuffle)
+		copy every other 2nd item in deck into 2 vectors A and B, starting at index = 0 in the deck
+		A = indeces 0, 2, 4, 6, ...
+		B = indeces 1, 3, 5, 7, ...
+
+		2) if the size of the deck (n) is odd, AND inverse out shuffle,
+		then copy every other 2nd item in deck into 2 vectors A and B, starting at index = 1 in the dexk
+		A = indeces 1, 3, 5, 7, ...
+		B = indeces 2, 4, 6, 8, ...
+
+		3) if the size of the deck (n) is odd, AND inverse in shuffle,
+		then copy every other 2nd item in deck into 2 vectors A and B, but stop at index = n-1 in the deck
+		A = indeces 1, 3, 5, 7, ...
+		B = indeces 2, 4, 6, 8, ...
+
+		4) Copy vectors A and B into the deck and interleave them as follows:
+			Inverse In, n odd  = BAy, where 'y' is index = n-1 in the deck (index at n-1 remains unchanged)
+			Inverse In, n even = BA
+		   Inverse Out, n odd  = xAB, where 'x' is index = 0 in the deck (index at 0 remains unchanged)
+		   Inverse Out, n even = AB
+
+		*/
+
+		if constexpr (S == ShuffleType::INV_INSHUFFLE)
 		{
-			// standard Fisher-Yates shuffle algorithm
-			for (size_t i = (m_deckSize - 1); i > 0; --i)
+			if constexpr (bIsDeckOdd)
 			{
-				std::uniform_int_distribution<size_t> uniDist(0, i);
-				size_t swapIndex = uniDist(m_urng);
-				std::swap(m_deck[i], m_deck[swapIndex]);
+				// inverse in shuffle, n = odd
+				// copy starting at index = 0, end at index = n - 1
+				// last card is unchanged
+				copy_every_n(m_deck.begin(), m_deck.end() - 1, vecFirstHalf, vecSecondHalf, 2);
+				copy(vecSecondHalf, vecSecondHalf + minSize, m_deck.begin());
+				copy(vecFirstHalf, vecFirstHalf + minSize, m_deck.begin() + half1);
+			}
+			else
+			{
+				// inverse in shuffle, n = even
+				copy_every_n(m_deck.begin(), m_deck.end(), vecFirstHalf, vecSecondHalf, 2);
+				copy(vecSecondHalf, vecSecondHalf + minSize, m_deck.begin());
+				copy(vecFirstHalf, vecFirstHalf + minSize, m_deck.begin() + half1);
 			}
-			break;
 		}
-
-		// For the inverse outshuffle and inverse inshuffle
-		case ShuffleType::INV_INSHUFFLE:
-		case ShuffleType::INV_OUTSHUFFLE:
+		else
 		{
-			// calculate the two halves of the deck, and assign them accordingly
-			// based on odd/even, which will change the number of cards to use for each half
-			// https://www.techiedelight.com/split-array-two-parts-java/
-			size_t half1, half2;
-			if (m_bIsDeckOdd)
-				half1 = (m_deckSize / 2);
+			if constexpr (bIsDeckOdd)
+			{
+				// inverse out shuffle, n = odd
+				// copy starting from index = 1
+				// first card is unchanged
+				copy_every_n(m_deck.begin() + 1, m_deck.end(), vecFirstHalf, vecSecondHalf, 2);
+				copy(vecSecondHalf, vecSecondHalf + minSize, m_deck.begin() + 1);
+				copy(vecFirstHalf, vecFirstHalf + minSize, m_deck.begin() + (half1 + 1));
+			}
 			else
-				half1 = ((m_deckSize + 1) / 2);
-			
-			// calc second half size, then take the minimum of 
-			// the two numbers for interleaving cards
-			half2 = (m_deckSize - half1);
-			size_t minSize = min(half1, half2);
-
-			// vectors for storing the two halves of the deck
-			std::vector<int> vecFirstHalf(minSize);
-			std::vector<int> vecSecondHalf(minSize);
-
-			/*
-
-			basic algorithm for inverse in and inverse out shuffles and interleaving the cards
-			1) if the size of the deck (n) is even (inverse in OR inverse out shuffle)
-			copy every other 2nd item in deck into 2 vectors A and B, starting at index = 0 in the deck
-			A = indeces 0, 2, 4, 6, ...
-			B = indeces 1, 3, 5, 7, ...
-
-			2) if the size of the deck (n) is odd, AND inverse out shuffle,
-			then copy every other 2nd item in deck into 2 vectors A and B, starting at index = 1 in the dexk
-			A = indeces 1, 3, 5, 7, ...
-			B = indeces 2, 4, 6, 8, ...
-
-			3) if the size of the deck (n) is odd, AND inverse in shuffle,
-			then copy every other 2nd item in deck into 2 vectors A and B, but stop at index = n-1 in the deck
-			A = indeces 1, 3, 5, 7, ...
-			B = indeces 2, 4, 6, 8, ...
-
-			4) Copy vectors A and B into the deck and interleave them as follows:
-				Inverse In, n odd  = BAy, where 'y' is index = n-1 in the deck (index at n-1 remains unchanged)
-				Inverse In, n even = BA
-			   Inverse Out, n odd  = xAB, where 'x' is index = 0 in the deck (index at 0 remains unchanged)
-			   Inverse Out, n even = AB
-
-			*/
-
-			if (shuffleType == ShuffleType::INV_INSHUFFLE)
 			{
-				if (m_bIsDeckOdd)
-				{
-					// inverse in shuffle, n = odd
-					// copy starting at index = 0, end at index = n - 1
-					// last card is unchanged
-					copy_every_n(m_deck.begin(), m_deck.end() - 1, vecFirstHalf.begin(), vecSecondHalf.begin(), 2);
-					copy(vecSecondHalf.begin(), vecSecondHalf.end(), m_deck.begin());
-					copy(vecFirstHalf.begin(), vecFirstHalf.end(), m_deck.begin() + half1);
-				}
-				else
-				{
-					// inverse in shuffle, n = even
-					copy_every_n(m_deck.begin(), m_deck.end(), vecFirstHalf.begin(), vecSecondHalf.begin(), 2);
-					copy(vecSecondHalf.begin(), vecSecondHalf.end(), m_deck.begin());
-					copy(vecFirstHalf.begin(), vecFirstHalf.end(), m_deck.begin() + half1);
-				}
+				// inverse out shuffle, n = even
+				copy_every_n(m_deck.begin(), m_deck.end(), vecFirstHalf, vecSecondHalf, 2);
+				copy(vecFirstHalf, vecFirstHalf + minSize, m_deck.begin());
+				copy(vecSecondHalf, vecSecondHalf + minSize, m_deck.begin() + half1);
 			}
+		}
+	}
+
+	// This is the improved version of the code to make shuffling faster by
+	// eliminating the need for copying the vector of cards at each iteration.
+	// Utilize copy_if and using pieces of the deck into two vectors to
+	// perform the shuffling, which does speed up things significantly.
+	else
+	{
+		// calculate the two halves of the deck, and assign them accordingly
+		// based on odd/even, and type of shuffle which will change the
+		// number of cards to use for each half
+		size_t half1, half2;
+		if constexpr (S == ShuffleType::INSHUFFLE)
+			half1 = (m_deckSize / 2);
+		else
+			half1 = ((m_deckSize + 1) / 2);
+
+		// calc second half size, then take the minimum of the two numbers for interleaving cards
+		half2 = (m_deckSize - half1);
+		size_t minSize = min(half1, half2);
 
-			if (shuffleType == ShuffleType::INV_OUTSHUFFLE)
+		// get the two halves of the deck, copied into the scratch
+		T* vecFirstHalf = GetScratch(m_deckSize);
+		T* vecSecondHalf = vecFirstHalf + half1;
+		copy(m_deck.begin(), m_deck.end(), vecFirstHalf);
+
+		// iterate through both halves, interleaving them
+		for (size_t nIndex = 0, i = 0; i < minSize; i++, nIndex += 2)
+		{
+			if constexpr (S == ShuffleType::INSHUFFLE)
 			{
-				if (m_bIsDeckOdd)
-				{
-					// inverse out shuffle, n = odd
-					// copy starting from index = 1
-					// first card is unchanged
-					copy_every_n(m_deck.begin() + 1, m_deck.end(), vecFirstHalf.begin(), vecSecondHalf.begin(), 2);
-					copy(vecSecondHalf.begin(), vecSecondHalf.end(), m_deck.begin() + 1);
-					copy(vecFirstHalf.begin(), vecFirstHalf.end(), m_deck.begin() + (half1 + 1));
-				}
-				else
-				{
-					// inverse out shuffle, n = even
-					copy_every_n(m_deck.begin(), m_deck.end(), vecFirstHalf.begin(), vecSecondHalf.begin(), 2);
-					copy(vecFirstHalf.begin(), vecFirstHalf.end(), m_deck.begin());
-					copy(vecSecondHalf.begin(), vecSecondHalf.end(), m_deck.begin() + half1);
-				}
+				// in shuffle interleaving
+				m_deck[nIndex] = vecSecondHalf[i];
+				m_deck[nIndex + 1] = vecFirstHalf[i];
+			}
+			else
+			{
+				// out shuffle interleaving
+				m_deck[nIndex] = vecFirstHalf[i];
+				m_deck[nIndex + 1] = vecSecondHalf[i];
 			}
-
-			break;
 		}
 
-		// This is the improved version of the code to make shuffling faster by
-		// eliminating the need for copying the vector of cards at each iteration.
-		// Utilize copy_if and using pieces of the deck into two vectors to
-		// perform the shuffling, which does speed up things significantly.
-		case ShuffleType::OUTSHUFFLE:
-		case ShuffleType::INSHUFFLE:
+		// in the case of an odd sized deck, determine how to assign the last card
+		// for an out shuffle, it's the last card of the first half
+		// for an in shuffle, it's the last card of the second half
+		if constexpr (bIsDeckOdd)
 		{
-			// calculate the two halves of the deck, and assign them accordingly
-			// based on odd/even, and type of shuffle which will change the
-			// number of cards to use for each half
-			size_t half1, half2;
-			if (shuffleType == ShuffleType::INSHUFFLE)
-				half1 = (m_deckSize / 2);
+			if constexpr (S == ShuffleType::INSHUFFLE)
+				m_deck[m_deckSize - 1] = vecSecondHalf[half2 - 1];
 			else
-				half1 = ((m_deckSize + 1) / 2);
+				m_deck[m_deckSize - 1] = vecFirstHalf[half1 - 1];
+		}
+	}
+}
 
-			// calc second half size, then take the minimum of the two numbers for interleaving cards
-			half2 = (m_deckSize - half1);
-			size_t minSize = min(half1, half2);
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::GetInShuffleRange(ShuffleType shuffleType, size_t deckSize, size_t& nOffset, size_t& nPairs)
+{
+	/*
 
-			// get the two halves of the deck
-			std::vector<T> vecFirstHalf(m_deck.begin(), m_deck.begin() + half1);
-			std::vector<T> vecSecondHalf(m_deck.begin() + half1, m_deck.end());
+	every perfect shuffle reduces to an in shuffle of an even sized range of the deck
+	   In, n odd  = in shuffle of indeces 0 .. n-2, last card is unchanged
+	   In, n even = in shuffle of the whole deck
+	  Out, n odd  = in shuffle of indeces 1 .. n-1, first card is unchanged
+	  Out, n even = in shuffle of indeces 1 .. n-2, first and last cards are unchanged
 
-			// iterate through both halves, interleaving them
-			for (int nIndex = 0, i = 0; i < minSize; i++, nIndex += 2)
-			{
-				if (shuffleType == ShuffleType::INSHUFFLE)
-				{
-					// in shuffle interleaving
-					m_deck[nIndex] = vecSecondHalf[i];
-					m_deck[nIndex + 1] = vecFirstHalf[i];
-				}
-				else
-				{
-					// out shuffle interleaving
-					m_deck[nIndex] = vecFirstHalf[i];
-					m_deck[nIndex + 1] = vecSecondHalf[i];
-				}
-			}
+	the inverse shuffles use the same ranges with the inverse in shuffle
+
+	*/
+
+	// no deck, or too few cards to shuffle, is an empty range
+	if (deckSize < MIN_DECK_SIZE)
+	{
+		nOffset = 0;
+		nPairs = 0;
+	}
+	else if (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::INV_INSHUFFLE)
+	{
+		nOffset = 0;
+		nPairs = deckSize / 2;
+	}
+	else
+	{
+		nOffset = 1;
+		nPairs = (deckSize - 1) / 2;
+	}
+}
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffleVectorized(ShuffleType shuffleType, T* pCards, size_t nCount)
+{
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, nCount, nOffset, nPairs);
+
+	T* pRange = pCards + nOffset;
+	T* pCopy = GetScratch(2 * nPairs);
+	std::copy(pRange, pRange + 2 * nPairs, pCopy);
 
-			// in the case of an odd sized deck, determine how to assign the last card
-			// for an out shuffle, it's the last card of the first half
-			// for an in shuffle, it's the last card of the second half
-			if (m_bIsDeckOdd)
+	// the in shuffle of a1 .. an b1 .. bn is b1 a1 b2 a2 ... bn an, and its inverse sends
+	// the odd indeces of the range to its first half and the even ones to its second half
+	if (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE)
+		ShuffleKernels::Interleave(pCopy + nPairs, pCopy, pRange, nPairs);
+	else
+		ShuffleKernels::Deinterleave(pCopy, pRange + nPairs, pRange, nPairs);
+}
+
+// the other kernels copy the cards out of the deck and shuffle them back in, this one
+// writes the shuffled deck into the second buffer and swaps the buffers, so each card
+// is read once and written once, and the old deck becomes the next shuffle's output
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffleDoubleBuffer(ShuffleType shuffleType)
+{
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, m_deckSize, nOffset, nPairs);
+
+	// the cards outside the in shuffle range stay where they are
+	const T* pDeck = m_deck.data();
+	T* pOut = GetScratch(m_deckSize);
+	std::copy(pDeck, pDeck + nOffset, pOut);
+	std::copy(pDeck + nOffset + 2 * nPairs, pDeck + m_deckSize, pOut + nOffset + 2 * nPairs);
+
+	const T* pRange = pDeck + nOffset;
+	T* pOutRange = pOut + nOffset;
+	if (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE)
+		ShuffleKernels::Interleave(pRange + nPairs, pRange, pOutRange, nPairs);
+	else
+		ShuffleKernels::Deinterleave(pRange, pOutRange + nPairs, pOutRange, nPairs);
+
+	SwapScratchIntoDeck();
+}
+
+// every output block of the in shuffle range only reads the matching blocks of the two
+// halves, so the range is copied once and each core interleaves (or deinterleaves) its
+// own fixed share of it, a deck that doesn't fit in cache is written with streaming
+// stores so it doesn't evict the copy being read
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffleParallel(ShuffleType shuffleType, T* pDeck, size_t nCount)
+{
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, nCount, nOffset, nPairs);
+	const bool bStream = nCount * sizeof(T) > ShuffleThreads::CACHE_SIZE_BYTES;
+
+	T* pCards = GetScratch(2 * nPairs);
+	T* pRange = pDeck + nOffset;
+	ShuffleThreads::ParallelFor(2 * nPairs, [=](size_t nBegin, size_t nEnd)
+	{
+		std::copy(pRange + nBegin, pRange + nEnd, pCards + nBegin);
+	});
+
+	if (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE)
+	{
+		// b1 a1 b2 a2 ... bn an
+		ShuffleThreads::ParallelFor(nPairs, [=](size_t nBegin, size_t nEnd)
+		{
+			ShuffleKernels::Interleave(pCards + nPairs + nBegin, pCards + nBegin, pRange + 2 * nBegin, nEnd - nBegin, bStream);
+		});
+	}
+	else
+	{
+		// a1 .. an b1 .. bn from b1 a1 b2 a2 ... bn an
+		ShuffleThreads::ParallelFor(nPairs, [=](size_t nBegin, size_t nEnd)
+		{
+			ShuffleKernels::Deinterleave(pCards + 2 * nBegin, pRange + nPairs + nBegin, pRange + nBegin, nEnd - nBegin, bStream);
+		});
+	}
+}
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::PerformShuffleInPlace(ShuffleType shuffleType, T* pCards, size_t nCount)
+{
+	size_t nOffset, nPairs;
+	GetInShuffleRange(shuffleType, nCount, nOffset, nPairs);
+
+	const bool bForward = (shuffleType == ShuffleType::INSHUFFLE || shuffleType == ShuffleType::OUTSHUFFLE);
+	if (m_shuffleMode == ShuffleMode::RECURSIVE)
+	{
+		if (bForward)
+			InShuffleRecursive(pCards + nOffset, nPairs);
+		else
+			InvInShuffleRecursive(pCards + nOffset, nPairs);
+		return;
+	}
+
+	if (bForward)
+		InShuffleInPlace(pCards + nOffset, nPairs);
+	else
+		InvInShuffleInPlace(pCards + nOffset, nPairs);
+}
+
+/*
+
+recursive in shuffle, split the pairs in half and rotate the middle so that each
+half of the range holds the two matching quarters, then in shuffle both halves
+	a1 .. am | am+1 .. an | b1 .. bm | bm+1 .. bn
+	a1 .. am   b1 .. bm | am+1 .. an   bm+1 .. bn
+
+every level is one streaming pass over the range, so O(n log n) moves in total, and
+once a half fits in a cache level all the levels below it run from that cache, which
+keeps every level of the memory hierarchy busy without knowing any of their sizes
+
+*/
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::InShuffleRecursive(T* pCards, size_t nPairs)
+{
+	// a handful of cards is done in registers, the cutoff is about call overhead, not cache size
+	const size_t BASE_PAIRS = 16;
+	if (nPairs <= BASE_PAIRS)
+	{
+		T cards[2 * BASE_PAIRS];
+		std::copy(pCards, pCards + 2 * nPairs, cards);
+		ShuffleKernels::Interleave(cards + nPairs, cards, pCards, nPairs);
+		return;
+	}
+
+	size_t m = nPairs / 2;
+	std::rotate(pCards + m, pCards + nPairs, pCards + nPairs + m);
+	InShuffleRecursive(pCards, m);
+	InShuffleRecursive(pCards + 2 * m, nPairs - m);
+}
+
+// the same steps backwards, inverse in shuffle both halves then rotate the middle back
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::InvInShuffleRecursive(T* pCards, size_t nPairs)
+{
+	const size_t BASE_PAIRS = 16;
+	if (nPairs <= BASE_PAIRS)
+	{
+		T cards[2 * BASE_PAIRS];
+		std::copy(pCards, pCards + 2 * nPairs, cards);
+		ShuffleKernels::Deinterleave(cards, pCards + nPairs, pCards, nPairs);
+		return;
+	}
+
+	size_t m = nPairs / 2;
+	InvInShuffleRecursive(pCards, m);
+	InvInShuffleRecursive(pCards + 2 * m, nPairs - m);
+	std::rotate(pCards + m, pCards + 2 * m, pCards + nPairs + m);
+}
+
+// in shuffle a1 .. an b1 .. bn into b1 a1 b2 a2 ... bn an using constant extra memory
+// Peiyush Jain, "A Simple In-Place Algorithm for In-Shuffle", 2004
+// https://arxiv.org/abs/0805.1598
+
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::InShuffleInPlace(T* pCards, size_t nPairs)
+{
+	while (nPairs > 0)
+	{
+		// find the largest 3^k <= 2n + 1, the cycles of j -> 2j mod 3^k
+		// on the positions 1 .. 3^k - 1 all start at a power of 3
+		size_t nModulus = 3;
+		while (nModulus <= (2 * nPairs + 1) / 3)
+			nModulus *= 3;
+		size_t m = (nModulus - 1) / 2;
+
+		// move b1 .. bm next to a1 .. am
+		std::rotate(pCards + m, pCards + nPairs, pCards + nPairs + m);
+
+		// in shuffle the first 2m cards by following each cycle from its leader
+		for (size_t nLeader = 1; nLeader < nModulus; nLeader *= 3)
+		{
+			size_t j = nLeader;
+			T card = pCards[j - 1];
+			do
 			{
-				if (shuffleType == ShuffleType::INSHUFFLE)
-					m_deck[m_deckSize - 1] = vecSecondHalf[half2 - 1];
-				else
-					m_deck[m_deckSize - 1] = vecFirstHalf[half1 - 1];
-			}
+				j = (2 * j) % nModulus;
+				std::swap(card, pCards[j - 1]);
+			} while (j != nLeader);
+		}
 
-			break;
+		// continue with the remaining cards
+		pCards += 2 * m;
+		nPairs -= m;
+	}
+}
+
+// inverse of InShuffleInPlace, b1 a1 b2 a2 ... bn an back into a1 .. an b1 .. bn
+template<class T, class URNG, class Allocator>
+void CardShuffler<T, URNG, Allocator>::InvInShuffleInPlace(T* pCards, size_t nPairs)
+{
+	// the rotations have to be undone in reverse order, there are at most
+	// log3(2n + 1) of them so a fixed size stack is enough
+	struct Segment { T* pCards; size_t nPairs; size_t m; };
+	Segment segments[64];
+	size_t nSegments = 0;
+
+	while (nPairs > 0)
+	{
+		size_t nModulus = 3;
+		while (nModulus <= (2 * nPairs + 1) / 3)
+			nModulus *= 3;
+		size_t m = (nModulus - 1) / 2;
+
+		// follow each cycle backwards, j -> j / 2 mod 3^k
+		for (size_t nLeader = 1; nLeader < nModulus; nLeader *= 3)
+		{
+			size_t j = nLeader;
+			T card = pCards[j - 1];
+			do
+			{
+				j = (j % 2 == 0) ? (j / 2) : ((j + nModulus) / 2);
+				std::swap(card, pCards[j - 1]);
+			} while (j != nLeader);
 		}
+
+		segments[nSegments++] = { pCards, nPairs, m };
+		pCards += 2 * m;
+		nPairs -= m;
+	}
+
+	// undo the rotations, innermost first
+	while (nSegments > 0)
+	{
+		const Segment& seg = segments[--nSegments];
+		std::rotate(seg.pCards + seg.m, seg.pCards + 2 * seg.m, seg.pCards + seg.nPairs + seg.m);
 	}
 }
@@ -0,0 +1,253 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>		// for system clock
+#include <cstdint>
+#include <limits>
+#include "CardShuffler.h"	// for ShuffleType and the perfect shuffle positions
+#include "ShuffleRandom.h"	// for the lane random number generators
+#include "ShuffleThreads.h"	// for ParallelFor
+
+// many independent decks of N cards shuffled together, the decks are stored in blocks of
+// BLOCK_DECKS with position p of every deck in the block next to each other, so a perfect
+// shuffle moves whole rows of cards and a random shuffle runs BLOCK_DECKS Fisher-Yates
+// shuffles side by side with one random number stream per deck
+template <class T, size_t N>
+class CardShufflerBatch
+{
+public:
+	static_assert(N >= 3, "deck must have at least 3 cards");
+	static_assert(N <= 0xFFFFFFFF, "the random swap indeces are drawn 32 bits at a time");
+	static_assert(N - 1 <= (std::numeric_limits<T>::is_integer ? (unsigned long long)std::numeric_limits<T>::max()
+		: 1ull << std::numeric_limits<T>::digits), "the cards 0 .. N-1 have to be exact in T");
+
+	static constexpr size_t DECK_SIZE = N;
+	static constexpr size_t BLOCK_DECKS = 64;
+
+	explicit CardShufflerBatch(size_t nDecks);
+	CardShufflerBatch(size_t nDecks, uint64_t seed);
+
+	// public member functions
+	size_t GetDeckCount() const { return m_nDecks; }
+	void ResetDecks();
+	void PerformShuffle(ShuffleType shuffle);
+	void PerformShuffles(ShuffleType shuffle, uint64_t k);
+	T CardAt(size_t nDeck, size_t nPosition) const;
+	std::vector<T> GetDeck(size_t nDeck) const;
+	bool IsDeckRestored(size_t nDeck) const;
+
+private:
+	typedef ShuffleRandom::Xoshiro256StarStarLanes<BLOCK_DECKS> LaneEngine;
+	typedef CardShuffler<size_t, ShuffleRandom::SplitMix64> PositionShuffler;
+	static constexpr size_t BLOCK_CARDS = N * BLOCK_DECKS;
+
+	// cards of block b, card p of deck d at m_cards[b * BLOCK_CARDS + p * BLOCK_DECKS + d]
+	std::vector<T> m_cards;
+	size_t m_nDecks;
+	size_t m_nBlocks;
+
+	// one random number stream per deck, kept a block at a time
+	std::vector<LaneEngine> m_engines;
+
+	// where each position takes its card from for the last perfect shuffle type and
+	// count asked for, empty until the first perfect shuffle
+	ShuffleType m_sourceShuffle;
+	uint64_t m_nSourceShuffles;
+	std::vector<size_t> m_source;
+
+	// calls func(bBegin, bEnd) on contiguous ranges of blocks, split across the cores
+	template <class F>
+	void ForEachBlocks(F func);
+
+	// the random shuffles, a Fisher-Yates shuffle of every deck in the block
+	static void FisherYatesBlock(T* pBlock, LaneEngine& engine);
+
+	// the source positions of shuffleType applied k times, rebuilt only when they change
+	const size_t* GetSourcePositions(ShuffleType shuffleType, uint64_t k);
+};
+
+// seeds the random number generators from the clock
+template<class T, size_t N>
+CardShufflerBatch<T, N>::CardShufflerBatch(size_t nDecks)
+	: CardShufflerBatch(nDecks, (uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count())
+{
+}
+
+// the same seed and deck count always give the same random shuffles
+template<class T, size_t N>
+CardShufflerBatch<T, N>::CardShufflerBatch(size_t nDecks, uint64_t seed)
+{
+	m_nDecks = nDecks;
+	m_nBlocks = (nDecks + BLOCK_DECKS - 1) / BLOCK_DECKS;
+	m_sourceShuffle = ShuffleType::OUTSHUFFLE;
+	m_nSourceShuffles = 0;
+	m_cards.resize(m_nBlocks * BLOCK_CARDS);
+
+	ShuffleRandom::SplitMix64 expand(seed);
+	m_engines.reserve(m_nBlocks);
+	for (size_t b = 0; b < m_nBlocks; b++)
+		m_engines.emplace_back(expand);
+
+	ResetDecks();
+}
+
+template<class T, size_t N>
+template<class F>
+void CardShufflerBatch<T, N>::ForEachBlocks(F func)
+{
+	// split the cards, block b goes to the chunk that holds its first card
+	ShuffleThreads::ParallelFor(m_nBlocks * BLOCK_CARDS, [=](size_t nBegin, size_t nEnd)
+	{
+		size_t bBegin = (nBegin + BLOCK_CARDS - 1) / BLOCK_CARDS;
+		size_t bEnd = (nEnd + BLOCK_CARDS - 1) / BLOCK_CARDS;
+		if (bBegin < bEnd)
+			func(bBegin, bEnd);
+	});
+}
+
+// every deck back to the cards 0 .. N-1 in order
+template<class T, size_t N>
+void CardShufflerBatch<T, N>::ResetDecks()
+{
+	T* pCards = m_cards.data();
+	ForEachBlocks([=](size_t bBegin, size_t bEnd)
+	{
+		for (size_t b = bBegin; b < bEnd; b++)
+		{
+			T* pBlock = pCards + b * BLOCK_CARDS;
+			for (size_t p = 0; p < N; p++)
+				std::fill(pBlock + p * BLOCK_DECKS, pBlock + (p + 1) * BLOCK_DECKS, (T)p);
+		}
+	});
+}
+
+template<class T, size_t N>
+void CardShufflerBatch<T, N>::PerformShuffle(ShuffleType shuffleType)
+{
+	PerformShuffles(shuffleType, 1);
+}
+
+// applies the same shuffle k times to every deck, every random shuffle type
+// draws a uniformly random permutation of each deck from that deck's stream
+template<class T, size_t N>
+void CardShufflerBatch<T, N>::PerformShuffles(ShuffleType shuffleType, uint64_t k)
+{
+	if (k == 0)
+		return;
+
+	T* pCards = m_cards.data();
+	if (PositionShuffler::IsRandomShuffle(shuffleType))
+	{
+		LaneEngine* pEngines = m_engines.data();
+		ForEachBlocks([=](size_t bBegin, size_t bEnd)
+		{
+			for (size_t b = bBegin; b < bEnd; b++)
+			{
+				for (uint64_t i = 0; i < k; i++)
+					FisherYatesBlock(pCards + b * BLOCK_CARDS, pEngines[b]);
+			}
+		});
+		return;
+	}
+
+	const size_t* pSource = GetSourcePositions(shuffleType, k);
+	ForEachBlocks([=](size_t bBegin, size_t bEnd)
+	{
+		// the pool threads live as long as the process, so each copy buffer is only allocated once
+		thread_local std::vector<T> vecBlock;
+		vecBlock.resize(BLOCK_CARDS);
+		for (size_t b = bBegin; b < bEnd; b++)
+		{
+			T* pBlock = pCards + b * BLOCK_CARDS;
+			std::copy(pBlock, pBlock + BLOCK_CARDS, vecBlock.begin());
+			for (size_t p = 0; p < N; p++)
+				std::copy(vecBlock.data() + pSource[p] * BLOCK_DECKS, vecBlock.data() + (pSource[p] + 1) * BLOCK_DECKS, pBlock + p * BLOCK_DECKS);
+		}
+	});
+}
+
+// the perfect shuffles move every deck the same way, shuffling the deck 0 .. N-1 once
+// leaves at each position the position its card has to come from
+template<class T, size_t N>
+const size_t* CardShufflerBatch<T, N>::GetSourcePositions(ShuffleType shuffleType, uint64_t k)
+{
+	if (m_source.empty() || shuffleType != m_sourceShuffle || k != m_nSourceShuffles)
+	{
+		PositionShuffler positions(0);
+		positions.GenerateDeck(N);
+		positions.PerformShuffles(shuffleType, k);
+		m_source = positions.GetDeck();
+		m_sourceShuffle = shuffleType;
+		m_nSourceShuffles = k;
+	}
+	return m_source.data();
+}
+
+template<class T, size_t N>
+void CardShufflerBatch<T, N>::FisherYatesBlock(T* pBlock, LaneEngine& engine)
+{
+	uint64_t draws[BLOCK_DECKS];
+	uint32_t indeces[BLOCK_DECKS];
+
+	for (size_t i = N - 1; i > 0; i--)
+	{
+		// each 64 bit draw gives two 32 bit indeces, the low half first
+		const int nShift = ((N - 1 - i) % 2 == 0) ? 0 : 32;
+		if (nShift == 0)
+			engine.Next(draws);
+
+		// Lemire's multiply and shift for every deck at once, the rare biased draw
+		// is redrawn afterwards so this loop has no branches
+		const uint32_t range = (uint32_t)(i + 1);
+		const uint32_t threshold = (uint32_t)(0 - range) % range;
+		uint32_t nBiased = 0;
+		for (size_t l = 0; l < BLOCK_DECKS; l++)
+		{
+			uint64_t m = (uint64_t)(uint32_t)(draws[l] >> nShift) * range;
+			indeces[l] = (uint32_t)(m >> 32);
+			nBiased |= (uint32_t)((uint32_t)m < threshold);
+		}
+
+		if (nBiased)
+		{
+			for (size_t l = 0; l < BLOCK_DECKS; l++)
+			{
+				uint64_t m = (uint64_t)(uint32_t)(draws[l] >> nShift) * range;
+				while ((uint32_t)m < threshold)
+					m = (uint64_t)(uint32_t)engine.NextLane(l) * range;
+				indeces[l] = (uint32_t)(m >> 32);
+			}
+		}
+
+		// swap card i of every deck with its drawn card
+		T* pRow = pBlock + i * BLOCK_DECKS;
+		for (size_t l = 0; l < BLOCK_DECKS; l++)
+			std::swap(pRow[l], pBlock[indeces[l] * BLOCK_DECKS + l]);
+	}
+}
+
+template<class T, size_t N>
+T CardShufflerBatch<T, N>::CardAt(size_t nDeck, size_t nPosition) const
+{
+	return m_cards[(nDeck / BLOCK_DECKS) * BLOCK_CARDS + nPosition * BLOCK_DECKS + nDeck % BLOCK_DECKS];
+}
+
+template<class T, size_t N>
+std::vector<T> CardShufflerBatch<T, N>::GetDeck(size_t nDeck) const
+{
+	std::vector<T> deck(N);
+	for (size_t p = 0; p < N; p++)
+		deck[p] = CardAt(nDeck, p);
+	return deck;
+}
+
+template<class T, size_t N>
+bool CardShufflerBatch<T, N>::IsDeckRestored(size_t nDeck) const
+{
+	for (size_t p = 0; p < N; p++)
+	{
+		if (CardAt(nDeck, p) != (T)p)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>		// for system clock
+#include <cstdint>
+#include <cstring>		// for memcpy
+#include <utility>		// for index_sequence
+#include "CardShuffler.h"	// for ShuffleType
+#include "ShuffleKernels.h"	// for the SSSE3/AVX-512 target macros
+#include "ShuffleRandom.h"	// for the default engine and Fisher-Yates indeces
+
+// a deck of N byte sized cards kept in a 64 or 128 byte array, small enough to shuffle
+// in registers, meant for the standard 52 card deck, 54 with jokers and 104 for two decks,
+// every perfect shuffle is a permutation table built at compile time and applied with
+// byte permutes, one vpermb (two vpermt2b for more than 64 cards) with AVX-512 VBMI, or
+// with SSSE3 a pshufb from each of the two or three 16 byte registers that feed every
+// output register, unrolled at compile time so the deck stays in registers throughout
+template <size_t N, class URNG = ShuffleRandom::Xoshiro256StarStar>
+class CardShufflerFixed
+{
+public:
+	static_assert(N >= 3, "deck must have at least 3 cards");
+	static_assert(N <= 128, "deck must fit in two 64 byte registers");
+
+	static constexpr size_t DECK_SIZE = N;
+
+	CardShufflerFixed();
+	explicit CardShufflerFixed(uint64_t seed);
+
+	// public member functions
+	std::array<uint8_t, N> GetDeck() const;
+	void ResetDeck();
+	void PerformShuffle(ShuffleType shuffle);
+	void PerformShuffles(ShuffleType shuffle, uint64_t k);
+	unsigned int RestoreDeck(ShuffleType shuffle);
+	bool IsDeckRestored() const;
+	uint8_t CardAt(size_t nPosition) const { return m_deck[nPosition]; }
+
+	URNG& GetRandomEngine() { return m_urng; }
+	void SetRandomEngine(const URNG& urng) { m_urng = urng; }
+
+private:
+	static constexpr size_t PADDED_SIZE = (N <= 64) ? 64 : 128;
+	static constexpr size_t REGISTERS = (N + 15) / 16;
+
+	// for OUTSHUFFLE, INSHUFFLE, INV_OUTSHUFFLE and INV_INSHUFFLE, the position each card
+	// comes from, and the same split into a pshufb mask for every pair of 16 byte output
+	// and input registers, 0x80 zeroes the bytes that come from another register
+	struct alignas(64) PermutationTables
+	{
+		uint8_t source[4][PADDED_SIZE];
+		uint8_t masks[4][REGISTERS][REGISTERS][16];
+		uint8_t uses[4][REGISTERS];		// bit s is set when input register s feeds the output register
+	};
+	static constexpr PermutationTables BuildTables();
+	static const PermutationTables TABLES;
+
+	// deck of cards, the bytes after the last card stay where they are
+	alignas(64) uint8_t m_deck[PADDED_SIZE];
+
+	// uniform random number generator for the random shuffle types
+	URNG m_urng;
+
+	// m_deck[i] = old m_deck[TABLES.source[nTable][i]]
+	template <size_t nTable>
+	void Permute();
+
+#if defined(SHUFFLE_KERNELS_SSSE3) && !defined(SHUFFLE_KERNELS_AVX512VBMI)
+	template <size_t nTable, size_t r, size_t s>
+	static void GatherInput(__m128i& out, const __m128i* pCards);
+	template <size_t nTable, size_t r, size_t... S>
+	static __m128i GatherRegister(const __m128i* pCards, std::index_sequence<S...>);
+	template <size_t nTable, size_t... R>
+	void PermuteRegisters(std::index_sequence<R...>);
+#endif
+};
+
+// seeds the random number generator from the clock
+template<size_t N, class URNG>
+CardShufflerFixed<N, URNG>::CardShufflerFixed()
+	: CardShufflerFixed((uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count())
+{
+}
+
+template<size_t N, class URNG>
+CardShufflerFixed<N, URNG>::CardShufflerFixed(uint64_t seed)
+	: m_urng(seed)
+{
+	ResetDeck();
+}
+
+template<size_t N, class URNG>
+constexpr typename CardShufflerFixed<N, URNG>::PermutationTables CardShufflerFixed<N, URNG>::BuildTables()
+{
+	PermutationTables tables{};
+	for (size_t t = 0; t < 4; t++)
+	{
+		// the in shuffle range the same way CardShuffler::GetInShuffleRange finds it,
+		// position j (1-indexed) of the range receives the card from j / 2 mod 2n + 1
+		// for the in shuffle, and from 2j for its inverse
+		const bool bIn = (t == 1 || t == 3);
+		const bool bForward = (t < 2);
+		const size_t nOffset = bIn ? 0 : 1;
+		const size_t nPairs = bIn ? N / 2 : (N - 1) / 2;
+		const size_t nModulus = 2 * nPairs + 1;
+
+		for (size_t i = 0; i < PADDED_SIZE; i++)
+		{
+			size_t nSource = i;
+			if (i >= nOffset && i < nOffset + 2 * nPairs)
+			{
+				const size_t j = i - nOffset + 1;
+				nSource = nOffset + (bForward ? (j * (nPairs + 1)) % nModulus : (2 * j) % nModulus) - 1;
+			}
+			tables.source[t][i] = (uint8_t)nSource;
+		}
+
+		for (size_t r = 0; r < REGISTERS; r++)
+		{
+			for (size_t s = 0; s < REGISTERS; s++)
+			{
+				for (size_t b = 0; b < 16; b++)
+				{
+					const size_t nSource = tables.source[t][16 * r + b];
+					const bool bFromS = (nSource / 16 == s);
+					tables.masks[t][r][s][b] = bFromS ? (uint8_t)(nSource % 16) : (uint8_t)0x80;
+					if (bFromS)
+						tables.uses[t][r] |= (uint8_t)(1 << s);
+				}
+			}
+		}
+	}
+	return tables;
+}
+
+// constexpr here rather than in the class, where BuildTables can't be called yet,
+// so the kernels below can read it at compile time
+template<size_t N, class URNG>
+constexpr typename CardShufflerFixed<N, URNG>::PermutationTables CardShufflerFixed<N, URNG>::TABLES = CardShufflerFixed<N, URNG>::BuildTables();
+
+template<size_t N, class URNG>
+std::array<uint8_t, N> CardShufflerFixed<N, URNG>::GetDeck() const
+{
+	std::array<uint8_t, N> deck;
+	std::copy(m_deck, m_deck + N, deck.begin());
+	return deck;
+}
+
+template<size_t N, class URNG>
+void CardShufflerFixed<N, URNG>::ResetDeck()
+{
+	for (size_t i = 0; i < PADDED_SIZE; i++)
+		m_deck[i] = (uint8_t)i;
+}
+
+template<size_t N, class URNG>
+void CardShufflerFixed<N, URNG>::PerformShuffle(ShuffleType shuffleType)
+{
+	switch (shuffleType)
+	{
+		case ShuffleType::OUTSHUFFLE:		Permute<0>(); break;
+		case ShuffleType::INSHUFFLE:		Permute<1>(); break;
+		case ShuffleType::INV_OUTSHUFFLE:	Permute<2>(); break;
+		case ShuffleType::INV_INSHUFFLE:	Permute<3>(); break;
+
+		case ShuffleType::STL_SHUFFLE:
+		{
+			std::shuffle(m_deck, m_deck + N, m_urng);
+			break;
+		}
+
+		// the other random shuffles only differ for decks far bigger than this one
+		default:
+		{
+			ShuffleRandom::FisherYatesIndices<URNG> swapIndeces(m_urng, N);
+			for (size_t i = N - 1; i > 0; --i)
+				std::swap(m_deck[i], m_deck[swapIndeces.Next()]);
+			break;
+		}
+	}
+}
+
+template<size_t N, class URNG>
+void CardShufflerFixed<N, URNG>::PerformShuffles(ShuffleType shuffleType, uint64_t k)
+{
+	for (uint64_t i = 0; i < k; i++)
+		PerformShuffle(shuffleType);
+}
+
+template<size_t N, class URNG>
+unsigned int CardShufflerFixed<N, URNG>::RestoreDeck(ShuffleType shuffle)
+{
+	unsigned int nShuffles = 0;
+
+	// run this loop until the deck has been restored
+	do
+	{
+		nShuffles++;
+		PerformShuffle(shuffle);
+	} while (IsDeckRestored() == false);
+
+	return nShuffles;
+}
+
+template<size_t N, class URNG>
+bool CardShufflerFixed<N, URNG>::IsDeckRestored() const
+{
+	for (size_t i = 0; i < N; i++)
+	{
+		if (m_deck[i] != (uint8_t)i)
+			return false;
+	}
+	return true;
+}
+
+template<size_t N, class URNG>
+template<size_t nTable>
+void CardShufflerFixed<N, URNG>::Permute()
+{
+#if defined(SHUFFLE_KERNELS_AVX512VBMI)
+	const uint8_t* pSource = TABLES.source[nTable];
+	if constexpr (PADDED_SIZE == 64)
+	{
+		__m512i cards = _mm512_load_si512(m_deck);
+		_mm512_store_si512(m_deck, _mm512_permutexvar_epi8(_mm512_load_si512(pSource), cards));
+	}
+	else
+	{
+		// the 7 bit indeces pick from the 128 bytes of both registers
+		__m512i lo = _mm512_load_si512(m_deck);
+		__m512i hi = _mm512_load_si512(m_deck + 64);
+		_mm512_store_si512(m_deck, _mm512_permutex2var_epi8(lo, _mm512_load_si512(pSource), hi));
+		_mm512_store_si512(m_deck + 64, _mm512_permutex2var_epi8(lo, _mm512_load_si512(pSource + 64), hi));
+	}
+#elif defined(SHUFFLE_KERNELS_SSSE3)
+	PermuteRegisters<nTable>(std::make_index_sequence<REGISTERS>());
+#else
+	uint8_t cards[PADDED_SIZE];
+	memcpy(cards, m_deck, PADDED_SIZE);
+	const uint8_t* pSource = TABLES.source[nTable];
+	for (size_t i = 0; i < N; i++)
+		m_deck[i] = cards[pSource[i]];
+#endif
+}
+
+#if defined(SHUFFLE_KERNELS_SSSE3) && !defined(SHUFFLE_KERNELS_AVX512VBMI)
+// one input register's share of an output register, nothing at all when it has no cards for it
+template<size_t N, class URNG>
+template<size_t nTable, size_t r, size_t s>
+void CardShufflerFixed<N, URNG>::GatherInput(__m128i& out, const __m128i* pCards)
+{
+	if constexpr (((TABLES.uses[nTable][r] >> s) & 1) != 0)
+	{
+		__m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(TABLES.masks[nTable][r][s]));
+		out = _mm_or_si128(out, _mm_shuffle_epi8(pCards[s], mask));
+	}
+}
+
+template<size_t N, class URNG>
+template<size_t nTable, size_t r, size_t... S>
+__m128i CardShufflerFixed<N, URNG>::GatherRegister(const __m128i* pCards, std::index_sequence<S...>)
+{
+	__m128i out = _mm_setzero_si128();
+	(GatherInput<nTable, r, S>(out, pCards), ...);
+	return out;
+}
+
+// every register of the deck is loaded before any is stored, and all the indeces are
+// constants, so the cards stay in registers between the loads and the stores
+template<size_t N, class URNG>
+template<size_t nTable, size_t... R>
+void CardShufflerFixed<N, URNG>::PermuteRegisters(std::index_sequence<R...>)
+{
+	const __m128i cards[REGISTERS] = { _mm_load_si128(reinterpret_cast<const __m128i*>(m_deck + 16 * R))... };
+	const __m128i out[REGISTERS] = { GatherRegister<nTable, R>(cards, std::make_index_sequence<REGISTERS>())... };
+	(_mm_store_si128(reinterpret_cast<__m128i*>(m_deck + 16 * R), out[R]), ...);
+}
+#endif
@@ -0,0 +1,394 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// SSE2 is part of every x64 target, AVX2 has to be enabled by the compiler (/arch:AVX2, -mavx2)
+// and brings SSSE3 with it, the AVX-512 byte permutes need -mavx512vbmi (MSVC has no flag for them)
+#if defined(__AVX512VBMI__)
+#define SHUFFLE_KERNELS_AVX512VBMI
+#endif
+#if defined(__AVX2__)
+#define SHUFFLE_KERNELS_AVX2
+#endif
+#if defined(__SSSE3__) || defined(SHUFFLE_KERNELS_AVX2)
+#define SHUFFLE_KERNELS_SSSE3
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SHUFFLE_KERNELS_SSE2
+#endif
+
+#if defined(SHUFFLE_KERNELS_AVX2) || defined(SHUFFLE_KERNELS_AVX512VBMI)
+#include <immintrin.h>
+#elif defined(SHUFFLE_KERNELS_SSSE3)
+#include <tmmintrin.h>
+#elif defined(SHUFFLE_KERNELS_SSE2)
+#include <emmintrin.h>
+#endif
+
+// vectorized building blocks for the perfect shuffles, any card type that is
+// not a trivially copyable 8, 16, 32 or 64 bit value falls back to a scalar loop
+namespace ShuffleKernels
+{
+	// hint that the cache line holding p is about to be used
+	inline void Prefetch(const void* p)
+	{
+#if defined(SHUFFLE_KERNELS_SSE2)
+		_mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#elif defined(__GNUC__)
+		__builtin_prefetch(p);
+#else
+		(void)p;
+#endif
+	}
+
+	template <class T>
+	constexpr bool IsVectorizable()
+	{
+		return std::is_trivially_copyable<T>::value &&
+			(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+	}
+
+	// the widest store the kernels make, streaming stores have to be aligned to it
+#if defined(SHUFFLE_KERNELS_AVX2)
+	const size_t VECTOR_BYTES = 32;
+#else
+	const size_t VECTOR_BYTES = 16;
+#endif
+
+	inline bool IsVectorAligned(const void* p)
+	{
+		return reinterpret_cast<uintptr_t>(p) % VECTOR_BYTES == 0;
+	}
+
+	// makes the streaming stores of this thread visible before it reports it is done
+	inline void StoreFence()
+	{
+#if defined(SHUFFLE_KERNELS_SSE2)
+		_mm_sfence();
+#endif
+	}
+
+#if defined(SHUFFLE_KERNELS_SSE2)
+	// interleave the low and high halves of two registers, W is the card width in bytes
+	template <size_t W>
+	inline __m128i UnpackLo(__m128i a, __m128i b)
+	{
+		if constexpr (W == 1) return _mm_unpacklo_epi8(a, b);
+		else if constexpr (W == 2) return _mm_unpacklo_epi16(a, b);
+		else if constexpr (W == 4) return _mm_unpacklo_epi32(a, b);
+		else return _mm_unpacklo_epi64(a, b);
+	}
+
+	template <size_t W>
+	inline __m128i UnpackHi(__m128i a, __m128i b)
+	{
+		if constexpr (W == 1) return _mm_unpackhi_epi8(a, b);
+		else if constexpr (W == 2) return _mm_unpackhi_epi16(a, b);
+		else if constexpr (W == 4) return _mm_unpackhi_epi32(a, b);
+		else return _mm_unpackhi_epi64(a, b);
+	}
+
+	template <size_t W>
+	inline __m128i Add(__m128i a, __m128i b)
+	{
+		if constexpr (W == 1) return _mm_add_epi8(a, b);
+		else if constexpr (W == 2) return _mm_add_epi16(a, b);
+		else if constexpr (W == 4) return _mm_add_epi32(a, b);
+		else return _mm_add_epi64(a, b);
+	}
+
+	// all ones in every lane where a == b
+	template <size_t W>
+	inline __m128i CmpEq(__m128i a, __m128i b)
+	{
+		if constexpr (W == 1) return _mm_cmpeq_epi8(a, b);
+		else if constexpr (W == 2) return _mm_cmpeq_epi16(a, b);
+		else if constexpr (W == 4) return _mm_cmpeq_epi32(a, b);
+		else
+		{
+			// SSE2 has no 64 bit compare, both 32 bit halves have to match
+			__m128i eq = _mm_cmpeq_epi32(a, b);
+			return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+		}
+	}
+
+	// a streaming store goes around the cache, p must be aligned when bStream is set
+	inline void Store(__m128i* p, __m128i v, bool bStream)
+	{
+		if (bStream)
+			_mm_stream_si128(p, v);
+		else
+			_mm_storeu_si128(p, v);
+	}
+#endif
+
+#if defined(SHUFFLE_KERNELS_AVX2)
+	// the 256 bit unpacks work on each 128 bit lane separately
+	template <size_t W>
+	inline __m256i UnpackLo(__m256i a, __m256i b)
+	{
+		if constexpr (W == 1) return _mm256_unpacklo_epi8(a, b);
+		else if constexpr (W == 2) return _mm256_unpacklo_epi16(a, b);
+		else if constexpr (W == 4) return _mm256_unpacklo_epi32(a, b);
+		else return _mm256_unpacklo_epi64(a, b);
+	}
+
+	template <size_t W>
+	inline __m256i UnpackHi(__m256i a, __m256i b)
+	{
+		if constexpr (W == 1) return _mm256_unpackhi_epi8(a, b);
+		else if constexpr (W == 2) return _mm256_unpackhi_epi16(a, b);
+		else if constexpr (W == 4) return _mm256_unpackhi_epi32(a, b);
+		else return _mm256_unpackhi_epi64(a, b);
+	}
+
+	template <size_t W>
+	inline __m256i Add(__m256i a, __m256i b)
+	{
+		if constexpr (W == 1) return _mm256_add_epi8(a, b);
+		else if constexpr (W == 2) return _mm256_add_epi16(a, b);
+		else if constexpr (W == 4) return _mm256_add_epi32(a, b);
+		else return _mm256_add_epi64(a, b);
+	}
+
+	template <size_t W>
+	inline __m256i CmpEq(__m256i a, __m256i b)
+	{
+		if constexpr (W == 1) return _mm256_cmpeq_epi8(a, b);
+		else if constexpr (W == 2) return _mm256_cmpeq_epi16(a, b);
+		else if constexpr (W == 4) return _mm256_cmpeq_epi32(a, b);
+		else return _mm256_cmpeq_epi64(a, b);
+	}
+
+	inline void Store(__m256i* p, __m256i v, bool bStream)
+	{
+		if (bStream)
+			_mm256_stream_si256(p, v);
+		else
+			_mm256_storeu_si256(p, v);
+	}
+#endif
+
+	// pDest = pFirst[0], pSecond[0], pFirst[1], pSecond[1], ...
+	// pDest must not overlap either source, bStream writes pDest with streaming stores
+	// when it can be aligned, for output that won't be read again while it is in cache
+	template <class T>
+	inline void Interleave(const T* pFirst, const T* pSecond, T* pDest, size_t nPairs, bool bStream = false)
+	{
+		size_t i = 0;
+
+#if defined(SHUFFLE_KERNELS_SSE2)
+		if constexpr (IsVectorizable<T>())
+		{
+			constexpr size_t W = sizeof(T);
+
+			// the output moves by a whole pair, so it lines up only from an even card
+			if (bStream && reinterpret_cast<uintptr_t>(pDest) % (2 * W) != 0)
+				bStream = false;
+			for (; bStream && i < nPairs && !IsVectorAligned(pDest + 2 * i); i++)
+			{
+				pDest[2 * i] = pFirst[i];
+				pDest[2 * i + 1] = pSecond[i];
+			}
+
+#if defined(SHUFFLE_KERNELS_AVX2)
+			// 32 bytes from each half, the lane crossing permute puts the
+			// unpacked lanes back in order before storing 64 bytes
+			constexpr size_t nLanes256 = 32 / W;
+			for (; i + nLanes256 <= nPairs; i += nLanes256)
+			{
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pFirst + i));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSecond + i));
+				__m256i lo = UnpackLo<W>(a, b);
+				__m256i hi = UnpackHi<W>(a, b);
+				Store(reinterpret_cast<__m256i*>(pDest + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20), bStream);
+				Store(reinterpret_cast<__m256i*>(pDest + 2 * i + nLanes256), _mm256_permute2x128_si256(lo, hi, 0x31), bStream);
+			}
+#endif
+
+			// 16 bytes from each half
+			constexpr size_t nLanes128 = 16 / W;
+			for (; i + nLanes128 <= nPairs; i += nLanes128)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pFirst + i));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSecond + i));
+				Store(reinterpret_cast<__m128i*>(pDest + 2 * i), UnpackLo<W>(a, b), bStream);
+				Store(reinterpret_cast<__m128i*>(pDest + 2 * i + nLanes128), UnpackHi<W>(a, b), bStream);
+			}
+			if (bStream)
+				StoreFence();
+		}
+#endif
+
+		// scalar tail, and the whole range for other card types
+		for (; i < nPairs; i++)
+		{
+			pDest[2 * i] = pFirst[i];
+			pDest[2 * i + 1] = pSecond[i];
+		}
+	}
+
+	// pEven = pSrc[0], pSrc[2], pSrc[4], ...
+	// pOdd  = pSrc[1], pSrc[3], pSrc[5], ...
+	// neither destination may overlap the source, bStream as for Interleave
+	template <class T>
+	inline void Deinterleave(const T* pSrc, T* pEven, T* pOdd, size_t nPairs, bool bStream = false)
+	{
+		size_t i = 0;
+
+#if defined(SHUFFLE_KERNELS_SSE2)
+		if constexpr (IsVectorizable<T>())
+		{
+			constexpr size_t W = sizeof(T);
+
+			// line up the even cards, the odd ones stream too if that lines them up as well
+			bool bStreamEven = bStream && reinterpret_cast<uintptr_t>(pEven) % W == 0;
+			for (; bStreamEven && i < nPairs && !IsVectorAligned(pEven + i); i++)
+			{
+				pEven[i] = pSrc[2 * i];
+				pOdd[i] = pSrc[2 * i + 1];
+			}
+			bool bStreamOdd = bStreamEven && IsVectorAligned(pOdd + i);
+
+#if defined(SHUFFLE_KERNELS_AVX2)
+			// the in lane packs and shuffles leave the 64 bit blocks in the order 0, 2, 1, 3
+			constexpr size_t nLanes256 = 32 / W;
+			constexpr int nLaneOrder = _MM_SHUFFLE(3, 1, 2, 0);
+			for (; i + nLanes256 <= nPairs; i += nLanes256)
+			{
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + 2 * i));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + 2 * i + nLanes256));
+				__m256i even, odd;
+				if constexpr (W == 1)
+				{
+					const __m256i mask = _mm256_set1_epi16(0x00FF);
+					even = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+					odd = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+				}
+				else if constexpr (W == 2)
+				{
+					// sign extend each half so the saturating pack is exact
+					even = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16), _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+					odd = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+				}
+				else if constexpr (W == 4)
+				{
+					__m256 af = _mm256_castsi256_ps(a), bf = _mm256_castsi256_ps(b);
+					even = _mm256_castps_si256(_mm256_shuffle_ps(af, bf, _MM_SHUFFLE(2, 0, 2, 0)));
+					odd = _mm256_castps_si256(_mm256_shuffle_ps(af, bf, _MM_SHUFFLE(3, 1, 3, 1)));
+				}
+				else
+				{
+					even = _mm256_unpacklo_epi64(a, b);
+					odd = _mm256_unpackhi_epi64(a, b);
+				}
+				Store(reinterpret_cast<__m256i*>(pEven + i), _mm256_permute4x64_epi64(even, nLaneOrder), bStreamEven);
+				Store(reinterpret_cast<__m256i*>(pOdd + i), _mm256_permute4x64_epi64(odd, nLaneOrder), bStreamOdd);
+			}
+#endif
+
+			constexpr size_t nLanes128 = 16 / W;
+			for (; i + nLanes128 <= nPairs; i += nLanes128)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + 2 * i));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + 2 * i + nLanes128));
+				__m128i even, odd;
+				if constexpr (W == 1)
+				{
+					const __m128i mask = _mm_set1_epi16(0x00FF);
+					even = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+					odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+				}
+				else if constexpr (W == 2)
+				{
+					even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+					odd = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+				}
+				else if constexpr (W == 4)
+				{
+					__m128 af = _mm_castsi128_ps(a), bf = _mm_castsi128_ps(b);
+					even = _mm_castps_si128(_mm_shuffle_ps(af, bf, _MM_SHUFFLE(2, 0, 2, 0)));
+					odd = _mm_castps_si128(_mm_shuffle_ps(af, bf, _MM_SHUFFLE(3, 1, 3, 1)));
+				}
+				else
+				{
+					even = _mm_unpacklo_epi64(a, b);
+					odd = _mm_unpackhi_epi64(a, b);
+				}
+				Store(reinterpret_cast<__m128i*>(pEven + i), even, bStreamEven);
+				Store(reinterpret_cast<__m128i*>(pOdd + i), odd, bStreamOdd);
+			}
+			if (bStreamEven)
+				StoreFence();
+		}
+#endif
+
+		for (; i < nPairs; i++)
+		{
+			pEven[i] = pSrc[2 * i];
+			pOdd[i] = pSrc[2 * i + 1];
+		}
+	}
+
+	// index of the first card with pCards[i] != (T)(nFirst + i), or nCount if there is none
+	template <class T>
+	inline size_t FindIotaMismatch(const T* pCards, size_t nCount, size_t nFirst)
+	{
+		size_t i = 0;
+
+#if defined(SHUFFLE_KERNELS_SSE2)
+		if constexpr (IsVectorizable<T>() && std::is_integral<T>::value && !std::is_same<T, bool>::value)
+		{
+			constexpr size_t W = sizeof(T);
+
+			// the expected cards for the first block, the wrap around matches (T)(nFirst + i)
+			alignas(32) T expected[32 / W];
+			for (size_t l = 0; l < 32 / W; l++)
+				expected[l] = (T)(nFirst + l);
+
+#if defined(SHUFFLE_KERNELS_AVX2)
+			constexpr size_t nLanes256 = 32 / W;
+			__m256i iota256 = _mm256_load_si256(reinterpret_cast<const __m256i*>(expected));
+			alignas(32) T inc256[32 / W];
+			for (size_t l = 0; l < nLanes256; l++)
+				inc256[l] = (T)nLanes256;
+			const __m256i step256 = _mm256_load_si256(reinterpret_cast<const __m256i*>(inc256));
+			for (; i + nLanes256 <= nCount; i += nLanes256)
+			{
+				__m256i cards = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pCards + i));
+				if (_mm256_movemask_epi8(CmpEq<W>(cards, iota256)) != -1)
+					break;
+				iota256 = Add<W>(iota256, step256);
+			}
+
+			// pick up where the 256 bit loop stopped
+			for (size_t l = 0; l < 32 / W; l++)
+				expected[l] = (T)(nFirst + i + l);
+#endif
+
+			// stop at the first block with a mismatch, the scalar loop finds the card
+			constexpr size_t nLanes128 = 16 / W;
+			__m128i iota128 = _mm_load_si128(reinterpret_cast<const __m128i*>(expected));
+			alignas(16) T inc128[16 / W];
+			for (size_t l = 0; l < nLanes128; l++)
+				inc128[l] = (T)nLanes128;
+			const __m128i step128 = _mm_load_si128(reinterpret_cast<const __m128i*>(inc128));
+			for (; i + nLanes128 <= nCount; i += nLanes128)
+			{
+				__m128i cards = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCards + i));
+				if (_mm_movemask_epi8(CmpEq<W>(cards, iota128)) != 0xFFFF)
+					break;
+				iota128 = Add<W>(iota128, step128);
+			}
+		}
+#endif
+
+		for (; i < nCount; i++)
+		{
+			if (pCards[i] != (T)(nFirst + i))
+				return i;
+		}
+		return nCount;
+	}
+}
@@ -0,0 +1,448 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <numeric>		// for std::gcd
+#include <string>
+#include <vector>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>		// for _umul128
+#endif
+
+// number theory used to count perfect shuffles analytically, every modulus
+// that shows up is odd which lets all of the modular arithmetic use Montgomery form
+namespace ShuffleMath
+{
+	// full 128 bit product of two 64 bit numbers
+	inline uint64_t Mul128(uint64_t a, uint64_t b, uint64_t& hi)
+	{
+#if defined(__SIZEOF_INT128__)
+		unsigned __int128 p = (unsigned __int128)a * b;
+		hi = (uint64_t)(p >> 64);
+		return (uint64_t)p;
+#elif defined(_MSC_VER) && defined(_M_X64)
+		return _umul128(a, b, &hi);
+#else
+		uint64_t aLo = (uint32_t)a, aHi = a >> 32;
+		uint64_t bLo = (uint32_t)b, bHi = b >> 32;
+		uint64_t p0 = aLo * bLo, p1 = aLo * bHi, p2 = aHi * bLo, p3 = aHi * bHi;
+		uint64_t mid = (p0 >> 32) + (uint32_t)p1 + (uint32_t)p2;
+		hi = p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+		return (mid << 32) | (uint32_t)p0;
+#endif
+	}
+
+	// modular arithmetic for an odd modulus, values are kept as a * 2^64 mod n
+	class Montgomery
+	{
+	public:
+		Montgomery() : Montgomery(1) {}
+		explicit Montgomery(uint64_t n) : m_n(n)
+		{
+			// Newton iteration for n^-1 mod 2^64, each step doubles the correct bits
+			m_nInv = n;
+			for (int i = 0; i < 5; i++)
+				m_nInv *= 2 - n * m_nInv;
+
+			// 2^128 mod n by doubling 2^64 mod n another 64 times
+			m_r2 = (0 - n) % n;
+			for (int i = 0; i < 64; i++)
+				m_r2 = (m_r2 >= n - m_r2) ? (m_r2 - (n - m_r2)) : (m_r2 + m_r2);
+		}
+
+		uint64_t Modulus() const { return m_n; }
+		uint64_t To(uint64_t a) const { return Mul(a % m_n, m_r2); }
+		uint64_t From(uint64_t a) const { return Reduce(0, a); }
+		uint64_t One() const { return To(1); }
+
+		uint64_t Mul(uint64_t a, uint64_t b) const
+		{
+			uint64_t hi;
+			uint64_t lo = Mul128(a, b, hi);
+			return Reduce(hi, lo);
+		}
+
+		uint64_t Add(uint64_t a, uint64_t b) const
+		{
+			return (a >= m_n - b) ? (a - (m_n - b)) : (a + b);
+		}
+
+		// a / 2 mod n, works the same on Montgomery and plain values
+		uint64_t Halve(uint64_t a) const
+		{
+			return (a % 2 == 0) ? (a / 2) : (a / 2 + m_n / 2 + 1);
+		}
+
+		uint64_t Pow(uint64_t base, uint64_t exp) const
+		{
+			uint64_t result = One();
+			while (exp > 0)
+			{
+				if (exp & 1)
+					result = Mul(result, base);
+				base = Mul(base, base);
+				exp >>= 1;
+			}
+			return result;
+		}
+
+	private:
+		// (hi * 2^64 + lo) / 2^64 mod n, valid for hi < n
+		uint64_t Reduce(uint64_t hi, uint64_t lo) const
+		{
+			uint64_t mHi;
+			Mul128(lo * m_nInv, m_n, mHi);
+			return (hi >= mHi) ? (hi - mHi) : (hi - mHi + m_n);
+		}
+
+		uint64_t m_n;
+		uint64_t m_nInv;
+		uint64_t m_r2;
+	};
+
+	// deterministic Miller-Rabin for every 64 bit number
+	inline bool IsPrime(uint64_t n)
+	{
+		if (n < 2)
+			return false;
+		static const uint64_t smallPrimes[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+		for (uint64_t p : smallPrimes)
+		{
+			if (n % p == 0)
+				return n == p;
+		}
+
+		uint64_t d = n - 1;
+		int s = 0;
+		while ((d & 1) == 0)
+		{
+			d >>= 1;
+			s++;
+		}
+
+		Montgomery mont(n);
+		const uint64_t one = mont.One();
+		const uint64_t minusOne = mont.To(n - 1);
+		// these bases are enough for every n < 2^64
+		static const uint64_t bases[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+		for (uint64_t a : bases)
+		{
+			if (a % n == 0)
+				continue;
+			uint64_t x = mont.Pow(mont.To(a), d);
+			if (x == one || x == minusOne)
+				continue;
+			bool bComposite = true;
+			for (int r = 1; r < s && bComposite; r++)
+			{
+				x = mont.Mul(x, x);
+				if (x == minusOne)
+					bComposite = false;
+			}
+			if (bComposite)
+				return false;
+		}
+		return true;
+	}
+
+	// Pollard rho with Brent's cycle detection, returns a non trivial factor of an odd composite n
+	inline uint64_t PollardRho(uint64_t n)
+	{
+		Montgomery mont(n);
+		for (uint64_t c = 1; ; c++)
+		{
+			const uint64_t cm = mont.To(c);
+			uint64_t y = mont.To(2), x = y, ys = y, q = mont.One(), g = 1;
+			const uint64_t nBatch = 128;
+			for (uint64_t r = 1; g == 1; r <<= 1)
+			{
+				x = y;
+				for (uint64_t i = 0; i < r; i++)
+					y = mont.Add(mont.Mul(y, y), cm);
+
+				// batch the gcds by multiplying the differences together
+				for (uint64_t k = 0; k < r && g == 1; k += nBatch)
+				{
+					ys = y;
+					for (uint64_t i = 0; i < nBatch && i < r - k; i++)
+					{
+						y = mont.Add(mont.Mul(y, y), cm);
+						q = mont.Mul(q, (x > y) ? (x - y) : (y - x));
+					}
+					g = std::gcd(q, n);
+				}
+			}
+
+			// the batch overshot, step through it again one at a time
+			if (g == n)
+			{
+				do
+				{
+					ys = mont.Add(mont.Mul(ys, ys), cm);
+					g = std::gcd((x > ys) ? (x - ys) : (ys - x), n);
+				} while (g == 1);
+			}
+
+			if (g != n)
+				return g;
+		}
+	}
+
+	// prime factorization in a fixed size table, a 64 bit number has at most 15 distinct primes
+	struct Factorization
+	{
+		uint64_t primes[16];
+		int exponents[16];
+		int count = 0;
+
+		void Add(uint64_t p, int e = 1)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				if (primes[i] == p)
+				{
+					exponents[i] += e;
+					return;
+				}
+			}
+			primes[count] = p;
+			exponents[count] = e;
+			count++;
+		}
+	};
+
+	inline void FactorOdd(uint64_t n, Factorization& factors)
+	{
+		if (n == 1)
+			return;
+		if (IsPrime(n))
+		{
+			factors.Add(n);
+			return;
+		}
+		uint64_t d = PollardRho(n);
+		FactorOdd(d, factors);
+		FactorOdd(n / d, factors);
+	}
+
+	inline Factorization Factor(uint64_t n)
+	{
+		Factorization factors;
+
+		// take out the small primes first, rho only has to deal with what is left
+		for (uint64_t p = 2; p < 64 && p * p <= n; p += (p == 2) ? 1 : 2)
+		{
+			int e = 0;
+			while (n % p == 0)
+			{
+				n /= p;
+				e++;
+			}
+			if (e > 0)
+				factors.Add(p, e);
+		}
+		if (n > 1)
+			FactorOdd(n, factors);
+		return factors;
+	}
+
+	// smallest k > 0 with 2^k = 1 mod n, for an odd n > 1
+	inline uint64_t MultiplicativeOrderOf2(uint64_t n)
+	{
+		// the order modulo n is the lcm of the orders modulo each prime power of n
+		Factorization factors = Factor(n);
+		uint64_t order = 1;
+		for (int i = 0; i < factors.count; i++)
+		{
+			const uint64_t p = factors.primes[i];
+
+			// the order modulo p divides p - 1, strip every prime factor of p - 1 that is not needed
+			Montgomery montP(p);
+			const uint64_t two = montP.To(2), one = montP.One();
+			uint64_t orderP = p - 1;
+			Factorization factorsP = Factor(p - 1);
+			for (int j = 0; j < factorsP.count; j++)
+			{
+				const uint64_t q = factorsP.primes[j];
+				while (orderP % q == 0 && montP.Pow(two, orderP / q) == one)
+					orderP /= q;
+			}
+
+			// lifting to p^e multiplies the order by a power of p
+			uint64_t pe = p;
+			for (int e = 1; e < factors.exponents[i]; e++)
+				pe *= p;
+			if (pe != p)
+			{
+				Montgomery montPe(pe);
+				const uint64_t twoPe = montPe.To(2), onePe = montPe.One();
+				while (montPe.Pow(twoPe, orderP) != onePe)
+					orderP *= p;
+			}
+
+			order = order / std::gcd(order, orderP) * orderP;
+		}
+		return order;
+	}
+
+	// arbitrary precision unsigned integer, just enough to accumulate an lcm and print it
+	class BigUInt
+	{
+	public:
+		BigUInt(uint64_t value = 0)
+		{
+			while (value > 0)
+			{
+				m_limbs.push_back((uint32_t)value);
+				value >>= 32;
+			}
+		}
+
+		bool IsZero() const { return m_limbs.empty(); }
+		bool FitsUInt64() const { return m_limbs.size() <= 2; }
+		size_t BitCount() const
+		{
+			if (m_limbs.empty())
+				return 0;
+			size_t nBits = 32 * (m_limbs.size() - 1);
+			for (uint32_t top = m_limbs.back(); top > 0; top >>= 1)
+				nBits++;
+			return nBits;
+		}
+
+		// low 64 bits of the value
+		uint64_t ToUInt64() const
+		{
+			uint64_t value = 0;
+			for (size_t i = std::min<size_t>(m_limbs.size(), 2); i-- > 0; )
+				value = (value << 32) | m_limbs[i];
+			return value;
+		}
+
+		bool operator==(const BigUInt& other) const { return m_limbs == other.m_limbs; }
+		bool operator!=(const BigUInt& other) const { return m_limbs != other.m_limbs; }
+
+		void Mul(uint64_t m)
+		{
+			if ((m >> 32) == 0)
+			{
+				Mul32((uint32_t)m);
+				return;
+			}
+
+			// (hi * 2^32 + lo) * x = lo * x + (hi * x) << 32
+			BigUInt high = *this;
+			high.Mul32((uint32_t)(m >> 32));
+			Mul32((uint32_t)m);
+			high.m_limbs.insert(high.m_limbs.begin(), 0);
+			Add(high);
+		}
+
+		uint64_t Mod(uint64_t m) const
+		{
+			uint64_t r = 0;
+			if ((m >> 32) == 0)
+			{
+				for (size_t i = m_limbs.size(); i-- > 0; )
+					r = ((r << 32) | m_limbs[i]) % m;
+				return r;
+			}
+
+			// r can use all 64 bits, so shift the bits in one at a time
+			for (size_t i = m_limbs.size(); i-- > 0; )
+			{
+				for (int bit = 31; bit >= 0; bit--)
+				{
+					r = (r >= m - r) ? (r - (m - r)) : (r + r);
+					if ((m_limbs[i] >> bit) & 1)
+						r = (r == m - 1) ? 0 : (r + 1);
+				}
+			}
+			return r;
+		}
+
+		// this = lcm(this, m), lcm(0, m) is taken as m
+		void Lcm(uint64_t m)
+		{
+			if (m == 0)
+				return;
+			if (IsZero())
+			{
+				*this = BigUInt(m);
+				return;
+			}
+			Mul(m / std::gcd(Mod(m), m));
+		}
+
+		std::string ToString() const
+		{
+			if (IsZero())
+				return "0";
+
+			// peel off 9 decimal digits at a time
+			std::vector<uint32_t> limbs = m_limbs;
+			std::vector<uint32_t> chunks;
+			while (!limbs.empty())
+			{
+				uint64_t r = 0;
+				for (size_t i = limbs.size(); i-- > 0; )
+				{
+					uint64_t cur = (r << 32) | limbs[i];
+					limbs[i] = (uint32_t)(cur / 1000000000);
+					r = cur % 1000000000;
+				}
+				while (!limbs.empty() && limbs.back() == 0)
+					limbs.pop_back();
+				chunks.push_back((uint32_t)r);
+			}
+
+			std::string str = std::to_string(chunks.back());
+			for (size_t i = chunks.size() - 1; i-- > 0; )
+			{
+				std::string chunk = std::to_string(chunks[i]);
+				str.append(9 - chunk.size(), '0');
+				str += chunk;
+			}
+			return str;
+		}
+
+	private:
+		void Mul32(uint32_t m)
+		{
+			uint64_t carry = 0;
+			for (uint32_t& limb : m_limbs)
+			{
+				uint64_t cur = (uint64_t)limb * m + carry;
+				limb = (uint32_t)cur;
+				carry = cur >> 32;
+			}
+			if (carry > 0)
+				m_limbs.push_back((uint32_t)carry);
+			Trim();
+		}
+
+		void Add(const BigUInt& other)
+		{
+			if (m_limbs.size() < other.m_limbs.size())
+				m_limbs.resize(other.m_limbs.size(), 0);
+			uint64_t carry = 0;
+			for (size_t i = 0; i < m_limbs.size(); i++)
+			{
+				uint64_t cur = (uint64_t)m_limbs[i] + carry + (i < other.m_limbs.size() ? other.m_limbs[i] : 0);
+				m_limbs[i] = (uint32_t)cur;
+				carry = cur >> 32;
+			}
+			if (carry > 0)
+				m_limbs.push_back((uint32_t)carry);
+			Trim();
+		}
+
+		void Trim()
+		{
+			while (!m_limbs.empty() && m_limbs.back() == 0)
+				m_limbs.pop_back();
+		}
+
+		// little endian 32 bit limbs, no leading zero limbs
+		std::vector<uint32_t> m_limbs;
+	};
+}
@@ -0,0 +1,265 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include "ShuffleThreads.h"	// for ParallelFor
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX			// CardShuffler calls std::min and std::max
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>		// for VirtualAlloc
+#define SHUFFLE_MEMORY_VIRTUAL_ALLOC
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>		// for mmap and madvise
+#define SHUFFLE_MEMORY_MMAP
+#if defined(__linux__)
+#include <sys/syscall.h>	// for mbind and get_mempolicy, without linking libnuma
+#include <unistd.h>
+#endif
+#endif
+
+// memory for decks of hundreds of millions of cards, where a shuffle pass spends its time
+// on TLB misses and, on a machine with more than one socket, on reaching the one node the
+// whole deck was first touched on, use it through the allocator parameter
+//		CardShuffler<uint32_t, URNG, ShuffleMemory::HugePageAllocator<uint32_t>>
+namespace ShuffleMemory
+{
+	// allocations smaller than one huge page come from operator new
+	const size_t HUGE_PAGE_BYTES = (size_t)2 << 20;
+	const size_t GIGANTIC_PAGE_BYTES = (size_t)1 << 30;
+
+	enum class NumaPlacement
+	{
+		NONE,			// the pages go to the node of whichever thread first writes them, as with operator new
+		INTERLEAVE,		// the pages go round robin over the nodes, PARALLEL_TOUCH where that can't be set
+		// best effort only, the pool threads aren't pinned and take the chunks in no fixed
+		// order, so a page's node isn't tied to the thread that later shuffles those cards
+		PARALLEL_TOUCH,	// the pool threads write the fresh pages between them, spreading them over their nodes
+	};
+
+	inline size_t RoundToPages(size_t nBytes, size_t nPageBytes)
+	{
+		return (nBytes + nPageBytes - 1) / nPageBytes * nPageBytes;
+	}
+
+	// the size of every mapping AllocateLarge made, which depends on the pages it got,
+	// so FreeLarge looks it up instead of working it out from the size asked for
+	inline std::mutex& GetMappingMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	inline std::unordered_map<void*, size_t>& GetMappingSizes()
+	{
+		static std::unordered_map<void*, size_t> sizes;
+		return sizes;
+	}
+
+	// first write of every page from the pool threads, so the pages of a large buffer
+	// aren't all placed from the one thread that allocated it
+	inline void TouchPages(void* p, size_t nBytes)
+	{
+		const size_t PAGE_BYTES = 4096;
+		char* pBytes = static_cast<char*>(p);
+		ShuffleThreads::ParallelFor(nBytes / PAGE_BYTES, [=](size_t nBegin, size_t nEnd)
+		{
+			for (size_t i = nBegin; i < nEnd; i++)
+				pBytes[i * PAGE_BYTES] = 0;
+		});
+	}
+
+	// interleave the pages of a fresh mapping over the nodes the process may use,
+	// false when the kernel won't or there is only one node
+	inline bool InterleavePages(void* p, size_t nBytes)
+	{
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+		const int MPOL_INTERLEAVE_MODE = 3;
+		const unsigned long MPOL_F_MEMS_ALLOWED_FLAG = 1 << 2;
+		const unsigned long MAX_NODES = 1024;
+		unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+
+		// the kernel reads one bit less than maxnode
+		int nMode = 0;
+		if (syscall(SYS_get_mempolicy, &nMode, nodes, MAX_NODES + 1, nullptr, MPOL_F_MEMS_ALLOWED_FLAG) != 0)
+			return false;
+
+		size_t nNodes = 0;
+		for (unsigned long word : nodes)
+			nNodes += (size_t)__builtin_popcountl(word);
+		if (nNodes < 2)
+			return false;
+
+		return syscall(SYS_mbind, p, nBytes, MPOL_INTERLEAVE_MODE, nodes, MAX_NODES + 1, 0) == 0;
+#else
+		// Windows only places memory on a node by the first touch or one VirtualAllocExNuma
+		// call per range, so it gets PARALLEL_TOUCH instead
+		(void)p;
+		(void)nBytes;
+		return false;
+#endif
+	}
+
+	// page aligned memory for nBytes, huge pages when the system has them to give,
+	// then transparent huge pages, then normal pages, and operator new without a
+	// virtual memory API, only fails with bad_alloc when all of those do
+	inline void* AllocateLarge(size_t nBytes, NumaPlacement placement, bool bHugePages)
+	{
+		// every kind of page but the 1 GB ones maps whole 2 MB pages
+		size_t nSize = RoundToPages(nBytes, HUGE_PAGE_BYTES);
+		void* p = nullptr;
+
+#if defined(SHUFFLE_MEMORY_VIRTUAL_ALLOC)
+		// large pages need SeLockMemoryPrivilege, which the process has to be granted and enable
+		const size_t nLargePage = GetLargePageMinimum();
+		if (bHugePages && nLargePage != 0)
+		{
+			nSize = RoundToPages(nBytes, nLargePage);
+			p = VirtualAlloc(nullptr, nSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+		if (p == nullptr)
+			p = VirtualAlloc(nullptr, nSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (p == nullptr)
+			throw std::bad_alloc();
+#elif defined(SHUFFLE_MEMORY_MMAP)
+#if defined(MAP_HUGETLB)
+		// the 1 GB and 2 MB page pools are empty unless the administrator reserved them,
+		// only an allocation of 1 GB or more is worth rounding up to 1 GB pages
+		if (bHugePages)
+		{
+			// log2 of the page size in the bits from MAP_HUGE_SHIFT, which older headers lack
+			const int HUGE_SHIFT = 26;
+			int nFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+			if (nBytes >= GIGANTIC_PAGE_BYTES)
+			{
+				const size_t nGiganticSize = RoundToPages(nBytes, GIGANTIC_PAGE_BYTES);
+				p = mmap(nullptr, nGiganticSize, PROT_READ | PROT_WRITE, nFlags | (30 << HUGE_SHIFT), -1, 0);
+				if (p == MAP_FAILED)
+					p = nullptr;
+				else
+					nSize = nGiganticSize;
+			}
+			if (p == nullptr)
+			{
+				p = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, nFlags | (21 << HUGE_SHIFT), -1, 0);
+				if (p == MAP_FAILED)
+					p = nullptr;
+			}
+		}
+#endif
+		if (p == nullptr)
+		{
+			// transparent huge pages only back 2 MB aligned ranges, so map a page more
+			// than needed and unmap the ends that don't line up
+			void* pMap = mmap(nullptr, nSize + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (pMap == MAP_FAILED)
+				throw std::bad_alloc();
+
+			char* pStart = static_cast<char*>(pMap);
+			char* pAligned = reinterpret_cast<char*>(((uintptr_t)pStart + HUGE_PAGE_BYTES - 1) & ~(uintptr_t)(HUGE_PAGE_BYTES - 1));
+			if (pAligned != pStart)
+				munmap(pStart, pAligned - pStart);
+			if (pAligned + nSize != pStart + nSize + HUGE_PAGE_BYTES)
+				munmap(pAligned + nSize, (pStart + nSize + HUGE_PAGE_BYTES) - (pAligned + nSize));
+			p = pAligned;
+#if defined(MADV_HUGEPAGE)
+			if (bHugePages)
+				madvise(p, nSize, MADV_HUGEPAGE);
+#endif
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(GetMappingMutex());
+			GetMappingSizes()[p] = nSize;
+		}
+#else
+		(void)bHugePages;
+		p = ::operator new(nSize);
+#endif
+
+		// the placement has to be set before the first write decides it
+		if (placement == NumaPlacement::INTERLEAVE && !InterleavePages(p, nSize))
+			placement = NumaPlacement::PARALLEL_TOUCH;
+		if (placement == NumaPlacement::PARALLEL_TOUCH)
+			TouchPages(p, nBytes);
+		return p;
+	}
+
+	inline void FreeLarge(void* p)
+	{
+#if defined(SHUFFLE_MEMORY_VIRTUAL_ALLOC)
+		VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(SHUFFLE_MEMORY_MMAP)
+		size_t nSize;
+		{
+			std::lock_guard<std::mutex> lock(GetMappingMutex());
+			auto it = GetMappingSizes().find(p);
+			nSize = it->second;
+			GetMappingSizes().erase(it);
+		}
+		munmap(p, nSize);
+#else
+		::operator delete(p);
+#endif
+	}
+
+	// standard allocator over AllocateLarge, every instance can free what any other one
+	// allocated, so the deck and the scratch can always be swapped
+	template <class T>
+	class HugePageAllocator
+	{
+	public:
+		typedef T value_type;
+		typedef std::true_type is_always_equal;
+
+		explicit HugePageAllocator(NumaPlacement placement = NumaPlacement::INTERLEAVE, bool bHugePages = true)
+			: m_placement(placement), m_bHugePages(bHugePages)
+		{
+		}
+
+		template <class U>
+		HugePageAllocator(const HugePageAllocator<U>& other)
+			: m_placement(other.GetPlacement()), m_bHugePages(other.UsesHugePages())
+		{
+		}
+
+		T* allocate(size_t nCount)
+		{
+			if (nCount > (size_t)-1 / sizeof(T))
+				throw std::bad_alloc();
+			const size_t nBytes = nCount * sizeof(T);
+			if (nBytes < HUGE_PAGE_BYTES)
+				return static_cast<T*>(::operator new(nBytes));
+			return static_cast<T*>(AllocateLarge(nBytes, m_placement, m_bHugePages));
+		}
+
+		void deallocate(T* p, size_t nCount)
+		{
+			const size_t nBytes = nCount * sizeof(T);
+			if (nBytes < HUGE_PAGE_BYTES)
+				::operator delete(p);
+			else
+				FreeLarge(p);
+		}
+
+		NumaPlacement GetPlacement() const { return m_placement; }
+		bool UsesHugePages() const { return m_bHugePages; }
+
+	private:
+		NumaPlacement m_placement;
+		bool m_bHugePages;
+	};
+
+	template <class T, class U>
+	bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+
+	template <class T, class U>
+	bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+}
@@ -0,0 +1,470 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include "ShuffleKernels.h"	// for the SSE2/AVX2 target macros
+#include "ShuffleMath.h"	// for Mul128
+
+// random numbers for the random shuffle types
+namespace ShuffleRandom
+{
+	inline uint64_t RotateLeft(uint64_t x, int k)
+	{
+		return (x << k) | (x >> ((64 - k) & 63));
+	}
+
+	inline uint64_t RotateRight(uint64_t x, int k)
+	{
+		return (x >> k) | (x << ((64 - k) & 63));
+	}
+
+	// SplitMix64, Steele, Lea and Flood, "Fast Splittable Pseudorandom Number Generators", 2014
+	// 8 bytes of state, also used to expand one seed into the state of the other engines
+	class SplitMix64
+	{
+	public:
+		typedef uint64_t result_type;
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return std::numeric_limits<uint64_t>::max(); }
+
+		explicit SplitMix64(uint64_t seed = 0) : m_state(seed) {}
+		void seed(uint64_t seed) { m_state = seed; }
+
+		result_type operator()()
+		{
+			uint64_t z = (m_state += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+	private:
+		uint64_t m_state;
+	};
+
+	// xoshiro256**, Blackman and Vigna, "Scrambled Linear Pseudorandom Number Generators", 2018
+	// 32 bytes of state
+	class Xoshiro256StarStar
+	{
+	public:
+		typedef uint64_t result_type;
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return std::numeric_limits<uint64_t>::max(); }
+
+		explicit Xoshiro256StarStar(uint64_t seed = 0) { this->seed(seed); }
+
+		void seed(uint64_t seed)
+		{
+			// the state must not be all zero, SplitMix64 never gives four zeros in a row
+			SplitMix64 expand(seed);
+			for (uint64_t& word : m_state)
+				word = expand();
+		}
+
+		result_type operator()()
+		{
+			const uint64_t result = RotateLeft(m_state[1] * 5, 7) * 9;
+			const uint64_t t = m_state[1] << 17;
+			m_state[2] ^= m_state[0];
+			m_state[3] ^= m_state[1];
+			m_state[1] ^= m_state[2];
+			m_state[0] ^= m_state[3];
+			m_state[2] ^= t;
+			m_state[3] = RotateLeft(m_state[3], 45);
+			return result;
+		}
+
+	private:
+		uint64_t m_state[4];
+	};
+
+	// PCG64 (XSL RR 128/64), O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+	// Statistically Good Algorithms for Random Number Generation", 2014
+	// 32 bytes of state, a 128 bit LCG kept as two 64 bit halves
+	class PCG64
+	{
+	public:
+		typedef uint64_t result_type;
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return std::numeric_limits<uint64_t>::max(); }
+
+		explicit PCG64(uint64_t seed = 0) { this->seed(seed); }
+		PCG64(uint64_t seed, uint64_t stream) { this->seed(seed, stream); }
+
+		// same default increment as the reference pcg64
+		void seed(uint64_t seed) { SetState(seed, 0x5851F42D4C957F2Dull, 0x14057B7EF767814Full); }
+
+		// the increment has to be odd, every stream gives a different sequence
+		void seed(uint64_t seed, uint64_t stream) { SetState(seed, stream >> 63, (stream << 1) | 1); }
+
+		result_type operator()()
+		{
+			Step();
+			return RotateRight(m_stateHi ^ m_stateLo, (int)(m_stateHi >> 58));
+		}
+
+	private:
+		void SetState(uint64_t seed, uint64_t incHi, uint64_t incLo)
+		{
+			m_incHi = incHi;
+			m_incLo = incLo;
+			m_stateHi = 0;
+			m_stateLo = 0;
+			Step();
+			m_stateLo += seed;
+			m_stateHi += (m_stateLo < seed) ? 1 : 0;
+			Step();
+		}
+
+		// state = state * multiplier + increment mod 2^128
+		void Step()
+		{
+			const uint64_t multHi = 0x2360ED051FC65DA4ull, multLo = 0x4385DF649FCCF645ull;
+			uint64_t hi;
+			uint64_t lo = ShuffleMath::Mul128(m_stateLo, multLo, hi);
+			hi += m_stateLo * multHi + m_stateHi * multLo;
+			m_stateLo = lo + m_incLo;
+			m_stateHi = hi + m_incHi + ((m_stateLo < lo) ? 1 : 0);
+		}
+
+		uint64_t m_stateHi, m_stateLo;
+		uint64_t m_incHi, m_incLo;
+	};
+
+	// Philox4x64-10, Salmon, Moraes, Dror and Shaw, "Parallel Random Numbers: As Easy as 1, 2, 3", 2011
+	// counter based, output n is a pure function of (seed, stream, n), so any number of
+	// streams can be handed out without sharing state, and jumping ahead is O(1)
+	class Philox4x64
+	{
+	public:
+		typedef uint64_t result_type;
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return std::numeric_limits<uint64_t>::max(); }
+
+		explicit Philox4x64(uint64_t seed = 0, uint64_t stream = 0) { this->seed(seed, stream); }
+
+		void seed(uint64_t seed, uint64_t stream = 0)
+		{
+			m_key[0] = seed;
+			m_key[1] = stream;
+			m_position = 0;
+			m_bufferBlock = NO_BLOCK;
+		}
+
+		result_type operator()()
+		{
+			// each block of the counter gives four outputs
+			const uint64_t block = m_position >> 2;
+			if (block != m_bufferBlock)
+			{
+				GenerateBlock(block);
+				m_bufferBlock = block;
+			}
+			return m_buffer[m_position++ & 3];
+		}
+
+		// skip ahead n outputs
+		void discard(uint64_t n) { m_position += n; }
+
+		uint64_t GetSeed() const { return m_key[0]; }
+		uint64_t GetStream() const { return m_key[1]; }
+		uint64_t GetPosition() const { return m_position; }
+
+		// an independent generator with the same seed, starting at the beginning of another stream
+		Philox4x64 Stream(uint64_t stream) const { return Philox4x64(m_key[0], stream); }
+
+	private:
+		static constexpr uint64_t NO_BLOCK = std::numeric_limits<uint64_t>::max();
+
+		void GenerateBlock(uint64_t block)
+		{
+			uint64_t c0 = block, c1 = 0, c2 = 0, c3 = 0;
+			uint64_t k0 = m_key[0], k1 = m_key[1];
+			for (int round = 0; round < 10; round++)
+			{
+				uint64_t hi0, hi1;
+				uint64_t lo0 = ShuffleMath::Mul128(0xD2E7470EE14C6C93ull, c0, hi0);
+				uint64_t lo1 = ShuffleMath::Mul128(0xCA5A826395121157ull, c2, hi1);
+				c0 = hi1 ^ c1 ^ k0;
+				c1 = lo1;
+				c2 = hi0 ^ c3 ^ k1;
+				c3 = lo0;
+				k0 += 0x9E3779B97F4A7C15ull;
+				k1 += 0xBB67AE8584CAA73Bull;
+			}
+			m_buffer[0] = c0;
+			m_buffer[1] = c1;
+			m_buffer[2] = c2;
+			m_buffer[3] = c3;
+		}
+
+		uint64_t m_key[2];
+		uint64_t m_position;
+		uint64_t m_bufferBlock;
+		uint64_t m_buffer[4];
+	};
+
+	// LANES independent xoshiro256** generators with their state stored word by word,
+	// so one step of every lane is a handful of 64 bit shifts, adds and xors on whole
+	// registers, the multiplies by 5 and 9 become a shift and an add
+	template <size_t LANES>
+	class Xoshiro256StarStarLanes
+	{
+	public:
+		// every lane takes the next four words of expand as its state
+		explicit Xoshiro256StarStarLanes(SplitMix64& expand)
+		{
+			for (size_t l = 0; l < LANES; l++)
+			{
+				m_s0[l] = expand();
+				m_s1[l] = expand();
+				m_s2[l] = expand();
+				m_s3[l] = expand();
+			}
+		}
+
+		// the next output of every lane
+		void Next(uint64_t* pOut)
+		{
+			size_t l = 0;
+
+#if defined(SHUFFLE_KERNELS_AVX2)
+			for (; l + 4 <= LANES; l += 4)
+			{
+				__m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_s0 + l));
+				__m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_s1 + l));
+				__m256i s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_s2 + l));
+				__m256i s3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_s3 + l));
+
+				__m256i x5 = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+				__m256i r7 = _mm256_or_si256(_mm256_slli_epi64(x5, 7), _mm256_srli_epi64(x5, 57));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut + l), _mm256_add_epi64(_mm256_slli_epi64(r7, 3), r7));
+
+				__m256i t = _mm256_slli_epi64(s1, 17);
+				s2 = _mm256_xor_si256(s2, s0);
+				s3 = _mm256_xor_si256(s3, s1);
+				s1 = _mm256_xor_si256(s1, s2);
+				s0 = _mm256_xor_si256(s0, s3);
+				s2 = _mm256_xor_si256(s2, t);
+				s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(m_s0 + l), s0);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(m_s1 + l), s1);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(m_s2 + l), s2);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(m_s3 + l), s3);
+			}
+#endif
+
+#if defined(SHUFFLE_KERNELS_SSE2)
+			for (; l + 2 <= LANES; l += 2)
+			{
+				__m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_s0 + l));
+				__m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_s1 + l));
+				__m128i s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_s2 + l));
+				__m128i s3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_s3 + l));
+
+				__m128i x5 = _mm_add_epi64(_mm_slli_epi64(s1, 2), s1);
+				__m128i r7 = _mm_or_si128(_mm_slli_epi64(x5, 7), _mm_srli_epi64(x5, 57));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + l), _mm_add_epi64(_mm_slli_epi64(r7, 3), r7));
+
+				__m128i t = _mm_slli_epi64(s1, 17);
+				s2 = _mm_xor_si128(s2, s0);
+				s3 = _mm_xor_si128(s3, s1);
+				s1 = _mm_xor_si128(s1, s2);
+				s0 = _mm_xor_si128(s0, s3);
+				s2 = _mm_xor_si128(s2, t);
+				s3 = _mm_or_si128(_mm_slli_epi64(s3, 45), _mm_srli_epi64(s3, 19));
+
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(m_s0 + l), s0);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(m_s1 + l), s1);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(m_s2 + l), s2);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(m_s3 + l), s3);
+			}
+#endif
+
+			for (; l < LANES; l++)
+				pOut[l] = NextLane(l);
+		}
+
+		// the next output of lane l alone
+		uint64_t NextLane(size_t l)
+		{
+			const uint64_t result = RotateLeft(m_s1[l] * 5, 7) * 9;
+			const uint64_t t = m_s1[l] << 17;
+			m_s2[l] ^= m_s0[l];
+			m_s3[l] ^= m_s1[l];
+			m_s1[l] ^= m_s2[l];
+			m_s0[l] ^= m_s3[l];
+			m_s2[l] ^= t;
+			m_s3[l] = RotateLeft(m_s3[l], 45);
+			return result;
+		}
+
+	private:
+		uint64_t m_s0[LANES];
+		uint64_t m_s1[LANES];
+		uint64_t m_s2[LANES];
+		uint64_t m_s3[LANES];
+	};
+
+	// uniform random integers in [0, range) drawn from a 64 bit engine, using
+	// Lemire's nearly divisionless method, "Fast Random Integer Generation in an Interval", 2019,
+	// and the batched version from Brackett-Rozinsky and Lemire, "Batched Ranged Random
+	// Integer Generation", 2024, which gets several small indeces out of one 64 bit draw
+	template <class URNG>
+	class BoundedRandom
+	{
+	public:
+		static_assert(URNG::min() == 0 && (URNG::max() == std::numeric_limits<uint64_t>::max() ||
+			URNG::max() == std::numeric_limits<uint32_t>::max()),
+			"BoundedRandom needs an engine with 32 or 64 random bits per call");
+
+		explicit BoundedRandom(URNG& urng) : m_urng(urng), m_spareBits(0), m_bHaveSpare(false) {}
+
+		uint64_t Next64()
+		{
+			if constexpr (URNG::max() == std::numeric_limits<uint32_t>::max())
+			{
+				uint64_t lo = (uint32_t)m_urng();
+				return ((uint64_t)(uint32_t)m_urng() << 32) | lo;
+			}
+			else
+				return (uint64_t)m_urng();
+		}
+
+		// the two halves of a 64 bit draw are used one after the other
+		uint32_t Next32()
+		{
+			if (m_bHaveSpare)
+			{
+				m_bHaveSpare = false;
+				return m_spareBits;
+			}
+			uint64_t bits = Next64();
+			m_spareBits = (uint32_t)(bits >> 32);
+			m_bHaveSpare = true;
+			return (uint32_t)bits;
+		}
+
+		uint64_t Bounded64(uint64_t range)
+		{
+			uint64_t hi;
+			uint64_t lo = ShuffleMath::Mul128(Next64(), range, hi);
+			if (lo < range)
+			{
+				// only pay for the division when the draw might be biased
+				const uint64_t threshold = (0 - range) % range;
+				while (lo < threshold)
+					lo = ShuffleMath::Mul128(Next64(), range, hi);
+			}
+			return hi;
+		}
+
+		// same as Bounded64 with a 32 bit draw and a 64 bit product
+		uint32_t Bounded32(uint32_t range)
+		{
+			uint64_t m = (uint64_t)Next32() * range;
+			uint32_t lo = (uint32_t)m;
+			if (lo < range)
+			{
+				const uint32_t threshold = (0u - range) % range;
+				while (lo < threshold)
+				{
+					m = (uint64_t)Next32() * range;
+					lo = (uint32_t)m;
+				}
+			}
+			return (uint32_t)(m >> 32);
+		}
+
+		// indeces[j] in [0, range - j) for j = 0 .. nCount - 1 from one 64 bit draw,
+		// the product of the ranges has to be less than 2^64
+		void BoundedBatch(uint64_t range, size_t nCount, uint64_t* indeces)
+		{
+			uint64_t product = 1;
+			for (size_t j = 0; j < nCount; j++)
+				product *= range - j;
+
+			uint64_t leftover = DrawBatch(range, nCount, indeces);
+			if (leftover < product)
+			{
+				const uint64_t threshold = (0 - product) % product;
+				while (leftover < threshold)
+					leftover = DrawBatch(range, nCount, indeces);
+			}
+		}
+
+		uint64_t operator()(uint64_t range)
+		{
+			if ((range >> 32) == 0)
+				return Bounded32((uint32_t)range);
+			return Bounded64(range);
+		}
+
+	private:
+		// each multiply takes the next index from the high half and leaves the rest in the low half
+		uint64_t DrawBatch(uint64_t range, size_t nCount, uint64_t* indeces)
+		{
+			uint64_t bits = Next64();
+			for (size_t j = 0; j < nCount; j++)
+				bits = ShuffleMath::Mul128(bits, range - j, indeces[j]);
+			return bits;
+		}
+
+		URNG& m_urng;
+		uint32_t m_spareBits;
+		bool m_bHaveSpare;
+	};
+
+	// largest batch of Fisher-Yates indeces below range whose product still fits in 64 bits
+	inline size_t GetBatchSize(uint64_t range)
+	{
+		if (range < (1ull << 16))
+			return 4;
+		if (range < (1ull << 21))
+			return 3;
+		return 1;
+	}
+
+	// the swap indeces of a Fisher-Yates shuffle of nCount cards, in order, for card
+	// nCount - 1 down to card 1, every variant of the shuffle draws them through this
+	// so the same seed always gives the same permutation
+	template <class URNG>
+	class FisherYatesIndices
+	{
+	public:
+		FisherYatesIndices(URNG& urng, size_t nCount)
+			: m_random(urng), m_nCard(nCount - 1), m_nBuffered(0), m_nNext(0) {}
+
+		size_t Next()
+		{
+			if (m_nNext == m_nBuffered)
+				Refill();
+			return (size_t)m_indeces[m_nNext++];
+		}
+
+	private:
+		void Refill()
+		{
+			// large ranges take one index per 32 or 64 bit draw,
+			// small ranges take several indeces from each 64 bit draw
+			const uint64_t range = (uint64_t)m_nCard + 1;
+			size_t nBatch = std::min<size_t>(GetBatchSize(range), m_nCard);
+			if (nBatch == 1)
+				m_indeces[0] = m_random(range);
+			else
+				m_random.BoundedBatch(range, nBatch, m_indeces);
+
+			m_nCard -= nBatch;
+			m_nBuffered = nBatch;
+			m_nNext = 0;
+		}
+
+		BoundedRandom<URNG> m_random;
+		size_t m_nCard;			// next card whose swap index has not been drawn yet
+		size_t m_nBuffered;
+		size_t m_nNext;
+		uint64_t m_indeces[4];
+	};
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// splits the work of one shuffle across the cores of the machine
+namespace ShuffleThreads
+{
+	// smallest range worth handing to another thread
+	const size_t MIN_CHUNK_SIZE = 1 << 16;
+
+	// a deck bigger than this is assumed not to fit in the last level cache
+	const size_t CACHE_SIZE_BYTES = 32 << 20;
+
+	// and a block this size is assumed to stay in the per core L2 cache
+	const size_t BLOCK_SIZE_BYTES = 1 << 20;
+
+	inline size_t GetThreadCount(size_t nCount)
+	{
+		size_t nCores = std::max<size_t>(1, std::thread::hardware_concurrency());
+		return std::max<size_t>(1, std::min(nCores, nCount / MIN_CHUNK_SIZE));
+	}
+
+	// workers that stay alive between shuffles, so a run of shuffles doesn't pay
+	// for creating and joining a thread per core on every one of them
+	class ThreadPool
+	{
+	public:
+		// nWorkers threads besides the caller of Run
+		explicit ThreadPool(size_t nWorkers);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		// calls func(nTask) for every task 0 .. nTasks - 1 on the workers and the calling
+		// thread, and returns once all of them are done, a call from inside a task or
+		// while another thread is running the pool just runs the tasks on the caller
+		template <class F>
+		void Run(size_t nTasks, F& func);
+
+		// one worker per core besides the caller, started on first use
+		static ThreadPool& Shared();
+
+	private:
+		void WorkerLoop();
+		void RunTasks();
+
+		static bool& IsWorkerThread()
+		{
+			static thread_local bool bWorker = false;
+			return bWorker;
+		}
+
+		std::vector<std::thread> m_threads;
+		std::mutex m_runMutex;		// one Run at a time
+
+		// the current job, guarded by m_mutex except for the task counter
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_done;
+		void (*m_pInvoke)(void*, size_t);
+		void* m_pFunc;
+		size_t m_nTasks;
+		std::atomic<size_t> m_nNextTask;
+		size_t m_nBusyWorkers;
+		uint64_t m_nGeneration;
+		bool m_bStop;
+	};
+
+	inline ThreadPool::ThreadPool(size_t nWorkers)
+		: m_pInvoke(nullptr), m_pFunc(nullptr), m_nTasks(0), m_nNextTask(0), m_nBusyWorkers(0), m_nGeneration(0), m_bStop(false)
+	{
+		m_threads.reserve(nWorkers);
+		for (size_t t = 0; t < nWorkers; t++)
+			m_threads.emplace_back(&ThreadPool::WorkerLoop, this);
+	}
+
+	inline ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bStop = true;
+		}
+		m_wake.notify_all();
+		for (std::thread& thread : m_threads)
+			thread.join();
+	}
+
+	inline ThreadPool& ThreadPool::Shared()
+	{
+		static ThreadPool pool(std::max<size_t>(1, std::thread::hardware_concurrency()) - 1);
+		return pool;
+	}
+
+	template <class F>
+	void ThreadPool::Run(size_t nTasks, F& func)
+	{
+		if (nTasks <= 1 || m_threads.empty() || IsWorkerThread() || !m_runMutex.try_lock())
+		{
+			for (size_t nTask = 0; nTask < nTasks; nTask++)
+				func(nTask);
+			return;
+		}
+		std::lock_guard<std::mutex> run(m_runMutex, std::adopt_lock);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pInvoke = [](void* pFunc, size_t nTask) { (*static_cast<F*>(pFunc))(nTask); };
+			m_pFunc = &func;
+			m_nTasks = nTasks;
+			m_nNextTask = 0;
+			m_nBusyWorkers = m_threads.size();
+			m_nGeneration++;
+		}
+		m_wake.notify_all();
+
+		RunTasks();
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this] { return m_nBusyWorkers == 0; });
+	}
+
+	inline void ThreadPool::RunTasks()
+	{
+		for (size_t nTask = m_nNextTask++; nTask < m_nTasks; nTask = m_nNextTask++)
+			m_pInvoke(m_pFunc, nTask);
+	}
+
+	inline void ThreadPool::WorkerLoop()
+	{
+		IsWorkerThread() = true;
+		uint64_t nSeen = 0;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;)
+		{
+			m_wake.wait(lock, [&] { return m_bStop || m_nGeneration != nSeen; });
+			if (m_bStop)
+				return;
+			nSeen = m_nGeneration;
+
+			lock.unlock();
+			RunTasks();
+			lock.lock();
+
+			if (--m_nBusyWorkers == 0)
+				m_done.notify_one();
+		}
+	}
+
+	// calls func(nBegin, nEnd) on contiguous chunks that cover 0 .. nCount - 1,
+	// the chunks are fixed by nCount and the core count, not by which thread is free
+	template <class F>
+	void ParallelFor(size_t nCount, F func)
+	{
+		size_t nThreads = GetThreadCount(nCount);
+		if (nThreads <= 1)
+		{
+			func((size_t)0, nCount);
+			return;
+		}
+
+		auto chunk = [&](size_t t) { func(nCount * t / nThreads, nCount * (t + 1) / nThreads); };
+		ThreadPool::Shared().Run(nThreads, chunk);
+	}
+
+	// calls func(nTask) for every task 0 .. nTasks - 1, each thread takes the next
+	// task when it finishes one so tasks of different sizes still balance out
+	template <class F>
+	void ParallelForEach(size_t nTasks, F func)
+	{
+		ThreadPool::Shared().Run(nTasks, func);
+	}
+}
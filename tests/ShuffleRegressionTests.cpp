@@ -0,0 +1,123 @@
+// regression checks for the shuffler, a standalone program that returns non zero on a failure
+//		g++ -std=c++17 -O2 -pthread -I.. ShuffleRegressionTests.cpp
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include "../CardShuffler.h"
+
+static int s_nFailures = 0;
+
+static void Check(bool bPassed, const char* pszWhat, ShuffleMode mode, ShuffleType shuffle)
+{
+	if (!bPassed)
+	{
+		printf("FAILED: %s, mode %d, shuffle %d\n", pszWhat, (int)mode, (int)shuffle);
+		s_nFailures++;
+	}
+}
+
+// every shuffle type in every mode is a no-op on a shuffler whose deck was never generated,
+// the out shuffles used to underflow the size of the in shuffle range
+static void TestShuffleWithoutDeck()
+{
+	const ShuffleMode modes[] = { ShuffleMode::REFERENCE, ShuffleMode::IN_PLACE, ShuffleMode::VECTORIZED,
+		ShuffleMode::LAZY, ShuffleMode::PARALLEL, ShuffleMode::RECURSIVE, ShuffleMode::DOUBLE_BUFFER };
+	const ShuffleType shuffles[] = { ShuffleType::OUTSHUFFLE, ShuffleType::INSHUFFLE,
+		ShuffleType::INV_OUTSHUFFLE, ShuffleType::INV_INSHUFFLE };
+
+	for (ShuffleMode mode : modes)
+	{
+		for (ShuffleType shuffle : shuffles)
+		{
+			CardShuffler<int> shuffler;
+			shuffler.SetShuffleMode(mode);
+			shuffler.PerformShuffle(shuffle);
+			shuffler.PerformShuffles(shuffle, 3);
+			Check(shuffler.GetDeck().empty(), "shuffle without a deck", mode, shuffle);
+
+			int cards[2] = { 0, 1 };
+			shuffler.PerformShuffle(shuffle, cards, 0);
+			Check(cards[0] == 0 && cards[1] == 1, "shuffle of no caller cards", mode, shuffle);
+		}
+	}
+}
+
+// the inverse shuffles deinterleave with SSE2/AVX2 in VECTORIZED mode and copy every other
+// card in REFERENCE mode, every size from a few cards to several vector blocks of either
+// parity takes the vector loops, their scalar tails and the end cards through both
+template <class T>
+static void TestInverseShufflesAgainstReference()
+{
+	const ShuffleType shuffles[] = { ShuffleType::INV_OUTSHUFFLE, ShuffleType::INV_INSHUFFLE };
+	for (ShuffleType shuffle : shuffles)
+	{
+		for (size_t nCards = 3; nCards <= 200; nCards++)
+		{
+			CardShuffler<T> reference(0), vectorized(0);
+			reference.SetShuffleMode(ShuffleMode::REFERENCE);
+			vectorized.SetShuffleMode(ShuffleMode::VECTORIZED);
+			reference.GenerateDeck(nCards);
+			vectorized.GenerateDeck(nCards);
+
+			// PerformShuffles gathers the cards instead of running the kernels
+			for (int i = 0; i < 3; i++)
+			{
+				reference.PerformShuffle(shuffle);
+				vectorized.PerformShuffle(shuffle);
+			}
+			Check(reference.GetDeck() == vectorized.GetDeck(), "vectorized inverse shuffle matches the reference", ShuffleMode::VECTORIZED, shuffle);
+		}
+	}
+}
+
+// std::allocator that counts what it hands out, to see which memory a shuffler uses
+static size_t s_nCountedAllocations = 0;
+
+template <class T>
+struct CountingAllocator : std::allocator<T>
+{
+	typedef T value_type;
+	template <class U> struct rebind { typedef CountingAllocator<U> other; };
+
+	CountingAllocator() {}
+	template <class U> CountingAllocator(const CountingAllocator<U>&) {}
+
+	T* allocate(size_t nCount)
+	{
+		s_nCountedAllocations++;
+		return std::allocator<T>::allocate(nCount);
+	}
+};
+
+template <class T, class U>
+bool operator==(const CountingAllocator<T>&, const CountingAllocator<U>&) { return true; }
+
+template <class T, class U>
+bool operator!=(const CountingAllocator<T>&, const CountingAllocator<U>&) { return false; }
+
+// the positions and marks RestoreDeckCycles works on come from the deck's allocator
+static void TestRestoreDeckCyclesAllocator()
+{
+	CardShuffler<int, std::mt19937_64, CountingAllocator<int>> shuffler(0);
+	shuffler.SetShuffleMode(ShuffleMode::REFERENCE);
+	shuffler.GenerateDeck(52);
+
+	s_nCountedAllocations = 0;
+	ShuffleMath::BigUInt nShuffles = shuffler.RestoreDeckCycles(ShuffleType::OUTSHUFFLE);
+	Check(nShuffles == ShuffleMath::BigUInt(8), "52 card out shuffle restores after 8", ShuffleMode::REFERENCE, ShuffleType::OUTSHUFFLE);
+	Check(s_nCountedAllocations >= 3, "cycle temporaries use the deck allocator", ShuffleMode::REFERENCE, ShuffleType::OUTSHUFFLE);
+}
+
+int main()
+{
+	TestShuffleWithoutDeck();
+	TestInverseShufflesAgainstReference<uint8_t>();
+	TestInverseShufflesAgainstReference<uint16_t>();
+	TestInverseShufflesAgainstReference<uint32_t>();
+	TestInverseShufflesAgainstReference<uint64_t>();
+	TestRestoreDeckCyclesAllocator();
+
+	if (s_nFailures == 0)
+		printf("all tests passed\n");
+	return s_nFailures == 0 ? 0 : 1;
+}